@@ -4,6 +4,10 @@
 // [X] String Slicing - zero-copy string handling
 // [X] Buffer Reuse - reusable buffers for temporary operations
 // [X] Input Buffer - single file read with mmap support
+// [X] Structural Index - SIMD stage 1 marks structurals/quotes, stage 2 parses from it (--index)
+// [X] Tape DOM - parsed records are one flat array of 8-byte words with skip counts
+
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,8 +16,19 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#if defined(__AVX2__) || defined(__PCLMUL__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 static void die(const char *msg)
 {
@@ -21,6 +36,30 @@ static void die(const char *msg)
     exit(1);
 }
 
+// Command line switches, set once by main and read-only afterwards
+typedef struct
+{
+    int use_index;          // SIMD structural index (stage 1)
+    int ndjson;             // input is one JSON object per line
+    const char *columns;    // --columns: comma separated dotted paths
+    int pushdown;           // --columns or --where: resolve paths while parsing
+    size_t nthreads;        // parse workers for the tree engine
+    size_t header_reserve;  // --stream: bytes kept for the header
+    const char *schema_cache; // --direct: header list saved between runs
+    uint64_t schema_key;    // hash of the options that shape the header
+    int hugepages;          // prefault the input, 2 MiB pages for arenas
+    int pipeline;           // --stream on reader/parser/formatter/writer threads
+    int validate_utf8;      // reject input that is not well-formed UTF-8
+    size_t max_depth;       // containers nested inside one record
+} Options;
+
+static Options G_opt = {
+    .use_index = 0,
+    .nthreads = 1,
+    .header_reserve = 64u << 10,
+    .max_depth = 1024,
+};
+
 // ---------------- String Slice (zero-copy) ----------------
 typedef struct {
     const char *ptr;
@@ -42,6 +81,18 @@ static int slice_eq(StrSlice a, StrSlice b)
     return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
 }
 
+// FNV-1a
+static uint64_t slice_hash(StrSlice s)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < s.len; i++)
+    {
+        h ^= (unsigned char)s.ptr[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
 static int slice_eq_cstr(StrSlice s, const char *cstr)
 {
     size_t clen = strlen(cstr);
@@ -49,36 +100,169 @@ static int slice_eq_cstr(StrSlice s, const char *cstr)
 }
 
 // ---------------- Arena allocator ----------------
+//
+// A chain of blocks, newest first. The first block is ARENA_MIN_BLOCK bytes
+// unless arena_init says otherwise; each new block doubles up to
+// ARENA_MAX_BLOCK, and a request that does not fit in one gets a block of its
+// own. Blocks released by arena_reset are kept as spares for the next refill,
+// so a per-record mark/reset loop settles on a fixed set of blocks.
+#define ARENA_MIN_BLOCK (64u << 10)
+#define ARENA_MAX_BLOCK (64u << 20)
+#define ARENA_HUGE_PAGE (2u << 20)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t cap;             // bytes in data
+    size_t off;             // bytes handed out
+    int mapped;             // mmap'd (huge-page backed) rather than malloc'd
+    _Alignas(16) unsigned char data[];
+} ArenaBlock;
+
 typedef struct {
-    unsigned char *base;
-    size_t cap;
-    size_t off;
+    ArenaBlock *cur;
+    ArenaBlock *spare;
+    size_t next_cap;        // size of the next block
+    int huge;               // back blocks with transparent huge pages
+    size_t reserved;        // bytes in all blocks, spares included
+    size_t retired;         // bytes used in blocks behind cur
+    size_t high;            // high-water mark of bytes used
+    size_t nblocks;
 } Arena;
 
+// Position to roll back to; see arena_mark
+typedef struct {
+    ArenaBlock *blk;
+    size_t off;
+    size_t retired;
+} ArenaMark;
+
 static size_t a_align_up(size_t x, size_t a) { return (x + a - 1) & ~(a - 1); }
 
-static void arena_init(Arena *a, size_t cap)
+// first_block 0 means the default; huge maps every block in 2 MiB pages
+static void arena_init(Arena *a, size_t first_block, int huge)
+{
+    memset(a, 0, sizeof *a);
+    a->next_cap = first_block ? first_block : ARENA_MIN_BLOCK;
+    a->huge = huge;
+}
+
+static size_t arena_used(const Arena *a)
+{
+    return a->retired + (a->cur ? a->cur->off : 0);
+}
+
+static void arena_note_high(Arena *a)
+{
+    size_t used = arena_used(a);
+    if (used > a->high)
+        a->high = used;
+}
+
+static ArenaBlock *arena_block_new(Arena *a, size_t cap)
+{
+    ArenaBlock *b;
+    size_t bytes = sizeof(ArenaBlock) + cap;
+    if (a->huge)
+    {
+        // mmap only promises page alignment: over-map by one huge page and
+        // trim both ends so the block starts on a 2 MiB boundary
+        bytes = a_align_up(bytes, ARENA_HUGE_PAGE);
+        size_t span = bytes + ARENA_HUGE_PAGE;
+        char *raw = (char*)mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) die("arena mmap failed");
+        char *m = (char*)a_align_up((size_t)raw, ARENA_HUGE_PAGE);
+        if (m > raw)
+            munmap(raw, (size_t)(m - raw));
+        if (raw + span > m + bytes)
+            munmap(m + bytes, (size_t)(raw + span - (m + bytes)));
+#ifdef MADV_HUGEPAGE
+        madvise(m, bytes, MADV_HUGEPAGE);
+#endif
+        b = (ArenaBlock*)m;
+        b->mapped = 1;
+    }
+    else
+    {
+        b = (ArenaBlock*)malloc(bytes);
+        if (!b) die("arena malloc failed");
+        b->mapped = 0;
+    }
+    b->cap = bytes - sizeof(ArenaBlock);
+    b->off = 0;
+    a->reserved += bytes;
+    a->nblocks++;
+    return b;
+}
+
+static void arena_block_free(Arena *a, ArenaBlock *b)
 {
-    a->base = (unsigned char*)malloc(cap);
-    if (!a->base) die("arena malloc failed");
-    a->cap = cap;
-    a->off = 0;
+    size_t bytes = sizeof(ArenaBlock) + b->cap;
+    a->reserved -= bytes;
+    a->nblocks--;
+    if (b->mapped)
+        munmap(b, bytes);
+    else
+        free(b);
 }
 
 static void arena_destroy(Arena *a)
 {
-    free(a->base);
-    a->base = NULL;
-    a->cap = a->off = 0;
+    ArenaBlock *lists[2] = {a->cur, a->spare};
+    for (int k = 0; k < 2; k++)
+        for (ArenaBlock *b = lists[k], *prev; b; b = prev)
+        {
+            prev = b->prev;
+            arena_block_free(a, b);
+        }
+    a->cur = a->spare = NULL;
+    a->retired = 0;
+}
+
+// Slow path of arena_alloc: retire cur and start a block with room for n
+static void *arena_refill(Arena *a, size_t n, size_t align)
+{
+    arena_note_high(a);
+    size_t need = n + align;
+    if (!a->next_cap)
+        a->next_cap = ARENA_MIN_BLOCK;
+
+    ArenaBlock *b = a->spare;
+    if (b && b->cap >= need)
+        a->spare = b->prev;
+    else
+    {
+        size_t cap = a->next_cap;
+        if (cap < need)
+            cap = need;             // oversized request: a block of its own
+        else if (a->next_cap < ARENA_MAX_BLOCK)
+            a->next_cap *= 2;
+        b = arena_block_new(a, cap);
+    }
+
+    if (a->cur)
+        a->retired += a->cur->off;
+    b->prev = a->cur;
+    b->off = 0;
+    a->cur = b;
+
+    size_t off = a_align_up((size_t)b->data, align) - (size_t)b->data;
+    b->off = off + n;
+    return b->data + off;
 }
 
 static void *arena_alloc(Arena *a, size_t n, size_t align)
 {
-    size_t off = a_align_up(a->off, align);
-    if (off + n > a->cap) die("arena out of memory");
-    void *p = a->base + off;
-    a->off = off + n;
-    return p;
+    ArenaBlock *b = a->cur;
+    if (b)
+    {
+        size_t off = a_align_up((size_t)(b->data + b->off), align) - (size_t)b->data;
+        if (off + n <= b->cap)
+        {
+            b->off = off + n;
+            return b->data + off;
+        }
+    }
+    return arena_refill(a, n, align);
 }
 
 static void *arena_alloc0(Arena *a, size_t n, size_t align)
@@ -105,21 +289,54 @@ static char *arena_slice_dup(Arena *a, StrSlice s)
     return p;
 }
 
-/* allocate new + memcpy old bytes (replacement for realloc growth) */
+/* extend in place when old is the newest allocation, else allocate new + memcpy */
 static void *arena_grow(Arena *a, void *old, size_t old_bytes, size_t new_bytes, size_t align)
 {
+    ArenaBlock *b = a->cur;
+    if (old && b && (unsigned char*)old + old_bytes == b->data + b->off
+        && (size_t)((unsigned char*)old - b->data) + new_bytes <= b->cap)
+    {
+        b->off = (size_t)((unsigned char*)old - b->data) + new_bytes;
+        return old;
+    }
     void *p = arena_alloc(a, new_bytes, align);
     if (old && old_bytes) memcpy(p, old, old_bytes);
     return p;
 }
 
-/* mark/reset for temporary allocations */
-static size_t arena_mark(Arena *a) { return a->off; }
-static void arena_reset(Arena *a, size_t mark) { a->off = mark; }
+/* mark/reset for temporary allocations; blocks past the mark become spares */
+static ArenaMark arena_mark(Arena *a)
+{
+    return (ArenaMark){a->cur, a->cur ? a->cur->off : 0, a->retired};
+}
+
+static void arena_reset(Arena *a, ArenaMark m)
+{
+    if (a->cur != m.blk)
+        arena_note_high(a);
+    while (a->cur != m.blk)
+    {
+        ArenaBlock *b = a->cur;
+        a->cur = b->prev;
+        b->prev = a->spare;
+        a->spare = b;
+    }
+    if (a->cur)
+        a->cur->off = m.off;
+    a->retired = m.retired;
+}
+
+static void arena_print_stats(const char *name, Arena *a)
+{
+    arena_note_high(a);
+    fprintf(stderr, "arena %-4s reserved %zu used %zu high-water %zu blocks %zu\n",
+            name, a->reserved, arena_used(a), a->high, a->nblocks);
+}
 
-// Two arenas: permanent (parse tree, headers) and temporary (flattening)
-static Arena A_perm;
-static Arena A_tmp;
+// Two arenas: permanent (parse tree, headers) and temporary (flattening).
+// Thread local so parallel parse workers each bump their own pair.
+static _Thread_local Arena A_perm;
+static _Thread_local Arena A_tmp;
 
 // Convenience wrappers (maintained for consistency with memory_opt)
 static void *xmalloc(size_t n)
@@ -210,7 +427,18 @@ static StrSlice strbuf_slice(const StrBuf *sb)
 static StrBuf G_tmpbuf1;
 static StrBuf G_tmpbuf2;
 
-// ---------------- JSON tree (using StrSlice) ----------------
+// ---------------- JSON tape (flat DOM) ----------------
+//
+// Parsed records are one contiguous array of 8-byte words in document order
+// instead of linked JValue nodes, so flattening walks memory linearly:
+//
+//   bits 63..56  tag: JType, plus TAPE_ESC for decoded strings
+//   bits 55..40  length of a number / string (TAPE_LEN_LONG: next word has it)
+//   bits 39..0   offset of the text in the input (or in esc when TAPE_ESC)
+//
+// J_BOOL keeps its value in the length field. J_ARRAY / J_OBJECT use bits
+// 55..0 for the number of words in their body, so a container is skipped in
+// O(1); object bodies are alternating key and value entries.
 
 typedef enum
 {
@@ -222,92 +450,354 @@ typedef enum
     J_OBJECT
 } JType;
 
-typedef struct JValue JValue;
+#define TAPE_ESC      0x80u
+#define TAPE_LEN_LONG 0xFFFFu
+#define TAPE_OFF_BITS 40
 
 typedef struct
 {
-    StrSlice key;
-    JValue *value;
-} JMember;
+    const char *base;   // input buffer the offsets are relative to
+    uint64_t *w;
+    size_t len, cap;    // words
+    StrBuf esc;         // decoded strings (those with escapes)
+    struct PathTrie *proj; // while building: paths for --columns/--where, or NULL
+    uint64_t seen;      // while building: --where columns tested in this record
+} Tape;
+
+static void tape_init(Tape *t, const char *base, size_t input_len, struct PathTrie *proj)
+{
+    t->base = base;
+    t->proj = proj;
+    t->len = 0;
+    t->cap = input_len / 8 + 64;
+    t->w = (uint64_t *)malloc(t->cap * sizeof *t->w);
+    if (!t->w) die("tape malloc failed");
+    strbuf_init(&t->esc, 4096);
+}
+
+static void tape_free(Tape *t)
+{
+    free(t->w);
+    t->w = NULL;
+    t->len = t->cap = 0;
+    strbuf_destroy(&t->esc);
+}
 
-struct JValue
+static size_t tape_push(Tape *t, uint64_t word)
 {
-    JType type;
-    union
+    if (t->len == t->cap)
     {
-        int boolean;
-        StrSlice number; // store as slice
-        StrSlice string; // store as slice
-        struct
-        {
-            JValue **items;
-            size_t len, cap;
-        } array;
-        struct
-        {
-            JMember *members;
-            size_t len, cap;
-        } object;
-    } as;
-};
+        t->cap *= 2;
+        t->w = (uint64_t *)realloc(t->w, t->cap * sizeof *t->w);
+        if (!t->w) die("tape realloc failed");
+    }
+    t->w[t->len] = word;
+    return t->len++;
+}
+
+static unsigned tape_type(const Tape *t, size_t i) { return (unsigned)(t->w[i] >> 56) & ~TAPE_ESC; }
 
-static JValue *jnew(JType t)
+// Number or string text at offset off of the input (esc = 0) or of t->esc
+static void tape_push_text(Tape *t, JType type, int esc, size_t off, size_t len)
 {
-    JValue *v = (JValue *)arena_alloc0(&A_perm, sizeof(JValue), _Alignof(JValue));
-    v->type = t;
-    return v;
+    if ((uint64_t)off >> TAPE_OFF_BITS)
+        die("input too large for tape");
+    uint64_t tag = type | (esc ? TAPE_ESC : 0);
+    uint64_t l = len < TAPE_LEN_LONG ? len : TAPE_LEN_LONG;
+    tape_push(t, tag << 56 | l << TAPE_OFF_BITS | off);
+    if (l == TAPE_LEN_LONG)
+        tape_push(t, len);
+}
+
+// Start a container; its body size is filled in by tape_close
+static size_t tape_open(Tape *t, JType type)
+{
+    return tape_push(t, (uint64_t)type << 56);
+}
+
+static void tape_close(Tape *t, size_t at)
+{
+    t->w[at] |= t->len - at - 1;
+}
+
+static void tape_push_bool(Tape *t, int b)
+{
+    tape_push(t, (uint64_t)J_BOOL << 56 | (uint64_t)(b != 0) << TAPE_OFF_BITS);
 }
 
-static void jarray_push(JValue *arr, JValue *item)
+static int tape_bool(const Tape *t, size_t i)
 {
-    if (arr->type != J_ARRAY)
-        die("internal: not array");
+    return (int)(t->w[i] >> TAPE_OFF_BITS & 1);
+}
+
+static StrSlice tape_slice(const Tape *t, size_t i)
+{
+    uint64_t w = t->w[i];
+    size_t off = (size_t)(w & (((uint64_t)1 << TAPE_OFF_BITS) - 1));
+    size_t len = (size_t)(w >> TAPE_OFF_BITS & TAPE_LEN_LONG);
+    if (len == TAPE_LEN_LONG)
+        len = (size_t)t->w[i + 1];
+    const char *src = (w >> 56 & TAPE_ESC) ? t->esc.data : t->base;
+    return slice_make(src + off, len);
+}
 
-    if (arr->as.array.len == arr->as.array.cap)
+// Index of the entry following entry i (skips whole containers)
+static size_t tape_next(const Tape *t, size_t i)
+{
+    unsigned type = tape_type(t, i);
+    if (type == J_ARRAY || type == J_OBJECT)
+        return i + 1 + (size_t)(t->w[i] & (((uint64_t)1 << 56) - 1));
+    if ((type == J_NUMBER || type == J_STRING) &&
+        (t->w[i] >> TAPE_OFF_BITS & TAPE_LEN_LONG) == TAPE_LEN_LONG)
+        return i + 2;
+    return i + 1;
+}
+
+// CSV text of a scalar entry
+static StrSlice slice_primitive(const Tape *t, size_t i)
+{
+    switch (tape_type(t, i))
     {
-        size_t oldcap = arr->as.array.cap;
-        size_t newcap = oldcap ? oldcap * 2 : 8;
+    case J_NULL:
+        return slice_from_cstr("null");
+    case J_BOOL:
+        return slice_from_cstr(tape_bool(t, i) ? "true" : "false");
+    case J_NUMBER:
+    case J_STRING:
+        return tape_slice(t, i);
+    default:
+        return slice_from_cstr("[complex]");
+    }
+}
 
-        arr->as.array.items = (JValue **)arena_grow(
-            &A_perm,
-            arr->as.array.items,
-            oldcap * sizeof(JValue *),
-            newcap * sizeof(JValue *),
-            _Alignof(JValue *)
-        );
-        arr->as.array.cap = newcap;
+// ---------------- Stage 1: structural index (SIMD) ----------------
+//
+// Classifies the input 64 bytes at a time into bitmasks (quotes, backslashes,
+// operators, whitespace), resolves escapes and string interiors with bit
+// tricks, and records the position of every token start outside strings:
+// { } [ ] : , both quotes of every string, and the first byte of each scalar.
+// The parser (stage 2) jumps between these positions instead of testing
+// every byte. Positions are produced in batches so the index stays small and
+// cache resident no matter how large the input is.
+
+#define IX_BATCH_BYTES (32u * 1024u)
+
+typedef struct {
+    const char *input;
+    size_t len;             // total input length
+    size_t scanned;         // bytes already classified
+    size_t base;            // input offset of the current batch
+    uint32_t pos[IX_BATCH_BYTES]; // batch-relative token positions
+    size_t n;               // filled entries
+    size_t at;              // next unread entry
+    uint64_t prev_in_string; // all ones if the last block ended inside a string
+    uint64_t prev_escaped;   // 1 if the next block starts with an escaped byte
+    uint64_t prev_scalar;    // 1 if the last block ended inside a scalar
+    size_t last_bslash;      // 1 + input offset of the last backslash seen, 0 if none
+} StructIndex;
+
+static void ix_init(StructIndex *ix, const char *input, size_t len)
+{
+    ix->input = input;
+    ix->len = len;
+    ix->scanned = 0;
+    ix->base = 0;
+    ix->n = ix->at = 0;
+    ix->prev_in_string = 0;
+    ix->prev_escaped = 0;
+    ix->prev_scalar = 0;
+    ix->last_bslash = 0;
+}
+
+typedef struct {
+    uint64_t quote;
+    uint64_t bslash;
+    uint64_t op;
+    uint64_t ws;
+} BlockMasks;
+
+#if defined(__AVX2__)
+static uint64_t ix_eq32(__m256i lo, __m256i hi, char c)
+{
+    __m256i k = _mm256_set1_epi8(c);
+    uint32_t a = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, k));
+    uint32_t b = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, k));
+    return (uint64_t)a | ((uint64_t)b << 32);
+}
+
+static BlockMasks ix_classify(const char *blk)
+{
+    __m256i lo = _mm256_loadu_si256((const __m256i *)blk);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(blk + 32));
+    BlockMasks m;
+    m.quote  = ix_eq32(lo, hi, '"');
+    m.bslash = ix_eq32(lo, hi, '\\');
+    m.op = ix_eq32(lo, hi, '{') | ix_eq32(lo, hi, '}') | ix_eq32(lo, hi, '[') |
+           ix_eq32(lo, hi, ']') | ix_eq32(lo, hi, ':') | ix_eq32(lo, hi, ',');
+    m.ws = ix_eq32(lo, hi, ' ') | ix_eq32(lo, hi, '\n') | ix_eq32(lo, hi, '\r') |
+           ix_eq32(lo, hi, '\t') | ix_eq32(lo, hi, '\v') | ix_eq32(lo, hi, '\f');
+    return m;
+}
+#elif defined(__SSE2__)
+static uint64_t ix_eq16(const __m128i v[4], char c)
+{
+    __m128i k = _mm_set1_epi8(c);
+    uint64_t r = 0;
+    for (int i = 0; i < 4; i++)
+        r |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], k)) << (16 * i);
+    return r;
+}
+
+static BlockMasks ix_classify(const char *blk)
+{
+    __m128i v[4];
+    for (int i = 0; i < 4; i++)
+        v[i] = _mm_loadu_si128((const __m128i *)(blk + 16 * i));
+    BlockMasks m;
+    m.quote  = ix_eq16(v, '"');
+    m.bslash = ix_eq16(v, '\\');
+    m.op = ix_eq16(v, '{') | ix_eq16(v, '}') | ix_eq16(v, '[') |
+           ix_eq16(v, ']') | ix_eq16(v, ':') | ix_eq16(v, ',');
+    m.ws = ix_eq16(v, ' ') | ix_eq16(v, '\n') | ix_eq16(v, '\r') |
+           ix_eq16(v, '\t') | ix_eq16(v, '\v') | ix_eq16(v, '\f');
+    return m;
+}
+#else
+static BlockMasks ix_classify(const char *blk)
+{
+    BlockMasks m = {0, 0, 0, 0};
+    for (int i = 0; i < 64; i++)
+    {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (blk[i])
+        {
+        case '"': m.quote |= bit; break;
+        case '\\': m.bslash |= bit; break;
+        case '{': case '}': case '[': case ']': case ':': case ',':
+            m.op |= bit; break;
+        case ' ': case '\n': case '\r': case '\t': case '\v': case '\f':
+            m.ws |= bit; break;
+        default: break;
+        }
     }
-    arr->as.array.items[arr->as.array.len++] = item;
+    return m;
+}
+#endif
+
+// bit i of the result = XOR of bits 0..i (turns quote marks into string regions)
+static uint64_t ix_prefix_xor(uint64_t x)
+{
+#if defined(__PCLMUL__)
+    __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long)x), _mm_set1_epi8((char)0xFF), 0);
+    return (uint64_t)_mm_cvtsi128_si64(r);
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
 }
 
-static void jobject_add(JValue *obj, StrSlice key, JValue *value)
+// Bytes preceded by an odd-length run of backslashes.
+static uint64_t ix_escaped(StructIndex *ix, uint64_t bslash)
 {
-    if (obj->type != J_OBJECT)
-        die("internal: not object");
+    const uint64_t ODD_BITS = 0xAAAAAAAAAAAAAAAAull;
 
-    if (obj->as.object.len == obj->as.object.cap)
+    if (!bslash)
     {
-        size_t oldcap = obj->as.object.cap;
-        size_t newcap = oldcap ? oldcap * 2 : 8;
+        uint64_t escaped = ix->prev_escaped;
+        ix->prev_escaped = 0;
+        return escaped;
+    }
+    uint64_t potential = bslash & ~ix->prev_escaped;
+    uint64_t maybe_escaped = potential << 1;
+    uint64_t series = ((maybe_escaped | ODD_BITS) - potential) ^ ODD_BITS;
+    uint64_t escaped = series ^ (bslash | ix->prev_escaped);
+    ix->prev_escaped = (series & bslash) >> 63;
+    return escaped;
+}
 
-        obj->as.object.members = (JMember *)arena_grow(
-            &A_perm,
-            obj->as.object.members,
-            oldcap * sizeof(JMember),
-            newcap * sizeof(JMember),
-            _Alignof(JMember)
-        );
-        obj->as.object.cap = newcap;
+static void ix_block(StructIndex *ix, const char *blk, uint32_t rel)
+{
+    BlockMasks m = ix_classify(blk);
+    if (m.bslash)
+        ix->last_bslash = ix->base + rel + 64 - (size_t)__builtin_clzll(m.bslash);
+
+    uint64_t quote = m.quote & ~ix_escaped(ix, m.bslash);
+    uint64_t in_string = ix_prefix_xor(quote) ^ ix->prev_in_string;
+    ix->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+    uint64_t scalar = ~(m.op | m.ws | quote | in_string);
+    uint64_t scalar_start = scalar & ~((scalar << 1) | ix->prev_scalar);
+    ix->prev_scalar = scalar >> 63;
+
+    uint64_t s = (m.op & ~in_string) | quote | scalar_start;
+    uint32_t *out = ix->pos + ix->n;
+    size_t cnt = 0;
+    while (s)
+    {
+        out[cnt++] = rel + (uint32_t)__builtin_ctzll(s);
+        s &= s - 1;
+    }
+    ix->n += cnt;
+}
+
+// Classify the next batch; returns 0 once the whole input is indexed.
+static int ix_fill(StructIndex *ix)
+{
+    while (ix->scanned < ix->len)
+    {
+        size_t end = ix->scanned + IX_BATCH_BYTES;
+        if (end > ix->len) end = ix->len;
+
+        ix->base = ix->scanned;
+        ix->n = ix->at = 0;
+
+        size_t off = ix->scanned;
+        for (; off + 64 <= end; off += 64)
+            ix_block(ix, ix->input + off, (uint32_t)(off - ix->base));
+        if (off < end)
+        {
+            // Tail: pad with whitespace, which never creates a token
+            char tail[64];
+            memset(tail, ' ', sizeof tail);
+            memcpy(tail, ix->input + off, end - off);
+            ix_block(ix, tail, (uint32_t)(off - ix->base));
+        }
+        ix->scanned = end;
+        if (ix->n) return 1;
     }
+    return 0;
+}
 
-    obj->as.object.members[obj->as.object.len].key = key;
-    obj->as.object.members[obj->as.object.len].value = value;
-    obj->as.object.len++;
+// Position of the first token at or after pos (input length if none).
+static size_t ix_seek(StructIndex *ix, size_t pos)
+{
+    for (;;)
+    {
+        while (ix->at < ix->n)
+        {
+            size_t q = ix->base + ix->pos[ix->at];
+            if (q >= pos) return q;
+            ix->at++;
+        }
+        if (!ix_fill(ix)) return ix->len;
+    }
 }
 
-static void jfree(JValue *v)
+// Given the opening quote of a string, return the position of its closing quote.
+static size_t ix_string_end(StructIndex *ix, size_t open)
 {
-    (void)v;
+    if (ix_seek(ix, open) != open)
+        die("internal: string not indexed");
+    ix->at++;
+    size_t close = ix_seek(ix, open + 1);
+    if (close >= ix->len || ix->input[close] != '"')
+        die("unterminated string");
+    return close;
 }
 
 // ---------------- Parser with string slicing ----------------
@@ -317,6 +807,9 @@ typedef struct
     const char *input;  // entire input buffer
     size_t pos;         // current position
     size_t len;         // total length
+    StructIndex *ix;    // stage-1 index, NULL to scan byte by byte
+    Arena *strings;     // where decoded (escaped) strings are copied,
+                        // NULL to leave them in temp for the caller
 } Parser;
 
 static int p_peek(Parser *p)
@@ -335,10 +828,28 @@ static void p_init(Parser *p, const char *input, size_t len)
     p->input = input;
     p->pos = 0;
     p->len = len;
+    p->ix = NULL;
+    p->strings = &A_perm;
+}
+
+// Drive the parser from a stage-1 index over its input (no-op if ix is NULL)
+static void p_attach_index(Parser *p, StructIndex *ix)
+{
+    if (!ix)
+        return;
+    ix_init(ix, p->input, p->len);
+    p->ix = ix;
 }
 
 static void p_skip_ws(Parser *p)
 {
+    if (p->ix)
+    {
+        // Everything between whitespace and the next indexed token is whitespace
+        if (p->pos < p->len && isspace((unsigned char)p->input[p->pos]))
+            p->pos = ix_seek(p->ix, p->pos);
+        return;
+    }
     while (p->pos < p->len && isspace((unsigned char)p->input[p->pos]))
         p->pos++;
 }
@@ -361,618 +872,3823 @@ static int hexval(int ch)
     return -1;
 }
 
-// Parse string and return as slice (if no escapes) or allocated (if escapes)
-static StrSlice parse_string(Parser *p, StrBuf *temp)
+// Index of the first '"' or '\\' in s[0, n), or n. Tests 32 bytes per step,
+// so clean runs between escapes never leave the vector loop.
+static size_t string_find_qb(const char *s, size_t n)
 {
-    p_expect(p, '"');
-    
-    size_t start = p->pos;
-    int has_escape = 0;
-    
-    // Fast path: scan for end, checking for escapes
-    while (p->pos < p->len && p->input[p->pos] != '"') {
-        if (p->input[p->pos] == '\\') {
-            has_escape = 1;
-            break;
-        }
-        p->pos++;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        uint32_t bits = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)));
+        if (bits)
+            return i + (size_t)__builtin_ctz(bits);
     }
-    
-    if (!has_escape && p->pos < p->len && p->input[p->pos] == '"') {
-        // No escapes: return slice directly into input
-        StrSlice result = slice_make(p->input + start, p->pos - start);
-        p_next(p); // skip closing "
-        return result;
+#elif defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    for (; i + 32 <= n; i += 32)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        uint32_t bits = (uint32_t)_mm_movemask_epi8(
+                            _mm_or_si128(_mm_cmpeq_epi8(a, quote), _mm_cmpeq_epi8(a, bslash))) |
+                        ((uint32_t)_mm_movemask_epi8(
+                            _mm_or_si128(_mm_cmpeq_epi8(b, quote), _mm_cmpeq_epi8(b, bslash))) << 16);
+        if (bits)
+            return i + (size_t)__builtin_ctz(bits);
     }
-    
-    // Slow path: has escapes, need to decode into buffer
-    strbuf_reset(temp);
-    p->pos = start; // reset to beginning
-    
-    while (p_peek(p) != EOF && p_peek(p) != '"')
+#endif
+    for (; i < n; i++)
+        if (s[i] == '"' || s[i] == '\\')
+            return i;
+    return n;
+}
+
+// Value of the 4 hex digits at s[i]
+static unsigned hex4(const char *s, size_t len, size_t i)
+{
+    unsigned v = 0;
+    for (size_t k = i; k < i + 4; k++)
+    {
+        int hv = k < len ? hexval((unsigned char)s[k]) : -1;
+        if (hv < 0)
+            die("bad \\u escape");
+        v = (v << 4) | (unsigned)hv;
+    }
+    return v;
+}
+
+static void utf8_push(StrBuf *temp, unsigned cp)
+{
+    char b[4];
+    size_t n;
+    if (cp < 0x80)
+    {
+        b[0] = (char)cp;
+        n = 1;
+    }
+    else if (cp < 0x800)
+    {
+        b[0] = (char)(0xC0 | (cp >> 6));
+        b[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        b[0] = (char)(0xE0 | (cp >> 12));
+        b[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        b[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    }
+    else
+    {
+        b[0] = (char)(0xF0 | (cp >> 18));
+        b[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        b[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        b[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    strbuf_append(temp, b, n);
+}
+
+// Decode the escape whose backslash is at s[q] onto temp; returns the
+// position just past it. \\u escapes become UTF-8, a surrogate pair one
+// 4-byte sequence; an unpaired surrogate becomes U+FFFD.
+static size_t decode_escape(const char *s, size_t len, size_t q, StrBuf *temp)
+{
+    if (q + 1 >= len)
+        die("bad escape");
+    switch (s[q + 1])
+    {
+    case '"':  strbuf_push(temp, '"');  return q + 2;
+    case '\\': strbuf_push(temp, '\\'); return q + 2;
+    case '/':  strbuf_push(temp, '/');  return q + 2;
+    case 'b':  strbuf_push(temp, '\b'); return q + 2;
+    case 'f':  strbuf_push(temp, '\f'); return q + 2;
+    case 'n':  strbuf_push(temp, '\n'); return q + 2;
+    case 'r':  strbuf_push(temp, '\r'); return q + 2;
+    case 't':  strbuf_push(temp, '\t'); return q + 2;
+    case 'u':
     {
-        int ch = p_peek(p);
-        if (ch == '\\')
+        unsigned cp = hex4(s, len, q + 2);
+        size_t next = q + 6;
+        if (cp >= 0xD800 && cp <= 0xDBFF && next + 1 < len && s[next] == '\\' && s[next + 1] == 'u')
         {
-            p_next(p);
-            if (p_peek(p) == EOF)
-                die("bad escape");
-            switch (p_peek(p))
-            {
-            case '"':
-                strbuf_push(temp, '"');
-                break;
-            case '\\':
-                strbuf_push(temp, '\\');
-                break;
-            case '/':
-                strbuf_push(temp, '/');
-                break;
-            case 'b':
-                strbuf_push(temp, '\b');
-                break;
-            case 'f':
-                strbuf_push(temp, '\f');
-                break;
-            case 'n':
-                strbuf_push(temp, '\n');
-                break;
-            case 'r':
-                strbuf_push(temp, '\r');
-                break;
-            case 't':
-                strbuf_push(temp, '\t');
-                break;
-            case 'u':
+            unsigned lo = hex4(s, len, next + 2);
+            if (lo >= 0xDC00 && lo <= 0xDFFF)
             {
-                int v = 0;
-                for (int i = 0; i < 4; i++)
-                {
-                    p_next(p);
-                    int hv = hexval(p_peek(p));
-                    if (hv < 0)
-                        die("bad \\u escape");
-                    v = (v << 4) | hv;
-                }
-                if (v <= 0x7F)
-                    strbuf_push(temp, (char)v);
-                else
-                    strbuf_push(temp, '?');
-                break;
-            }
-            default:
-                die("unknown escape");
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                next += 6;
             }
-            p_next(p);
         }
+        if (cp >= 0xD800 && cp <= 0xDFFF)
+            cp = 0xFFFD;
+        utf8_push(temp, cp);
+        return next;
+    }
+    default:
+        die("unknown escape");
+    }
+    return q;
+}
+
+// --validate-utf8: die unless s[0, n) is well-formed UTF-8 (no overlongs,
+// surrogates or code points past U+10FFFF). Outside strings JSON is ASCII, so
+// this runs once over the whole input (or each framed record) rather than per
+// string; ASCII is skipped 32 bytes per step by testing the high bits.
+static void utf8_validate(const char *s, size_t n)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    size_t i = 0;
+    while (i < n)
+    {
+#if defined(__AVX2__)
+        if (i + 32 <= n && !_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(u + i))))
+        {
+            i += 32;
+            continue;
+        }
+#elif defined(__SSE2__)
+        if (i + 32 <= n && !(_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(u + i))) |
+                             _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(u + i + 16)))))
+        {
+            i += 32;
+            continue;
+        }
+#endif
+        unsigned c = u[i];
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        size_t k;
+        unsigned cp, min;
+        if (c >= 0xC2 && c <= 0xDF)      { k = 1; cp = c & 0x1F; min = 0x80; }
+        else if (c >= 0xE0 && c <= 0xEF) { k = 2; cp = c & 0x0F; min = 0x800; }
+        else if (c >= 0xF0 && c <= 0xF4) { k = 3; cp = c & 0x07; min = 0x10000; }
         else
+            die("invalid UTF-8 in input");
+        if (i + k >= n)
+            die("invalid UTF-8 in input");
+        for (size_t j = 1; j <= k; j++)
         {
-            strbuf_push(temp, (char)ch);
-            p_next(p);
+            if ((u[i + j] & 0xC0) != 0x80)
+                die("invalid UTF-8 in input");
+            cp = (cp << 6) | (u[i + j] & 0x3F);
         }
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+            die("invalid UTF-8 in input");
+        i += k + 1;
     }
-    p_expect(p, '"');
-    
-    // Copy from temp buffer to arena
-    return slice_make(arena_slice_dup(&A_perm, strbuf_slice(temp)), temp->len);
 }
 
-static StrSlice parse_number(Parser *p)
+// Parse string and return as slice (if no escapes) or allocated (if escapes)
+static StrSlice parse_string(Parser *p, StrBuf *temp)
 {
-    size_t start = p->pos;
+    p_expect(p, '"');
     
-    if (p_peek(p) == '-') p_next(p);
+    size_t start = p->pos;
+    size_t q; // first quote or backslash
     
-    if (!isdigit(p_peek(p)))
-        die("bad number");
-        
-    if (p_peek(p) == '0')
+    if (p->ix)
     {
-        p_next(p);
+        // Stage 1 already knows where the string ends, and whether any
+        // backslash was classified at or after its start
+        size_t end = ix_string_end(p->ix, start - 1);
+        const char *bs = NULL;
+        if (p->ix->last_bslash > start)
+            bs = (const char *)memchr(p->input + start, '\\', end - start);
+        if (!bs)
+        {
+            p->pos = end + 1;
+            return slice_make(p->input + start, end - start);
+        }
+        q = (size_t)(bs - p->input);
     }
     else
     {
-        while (p_peek(p) != EOF && isdigit(p_peek(p)))
-            p_next(p);
+        // Fast path: no escapes, return slice directly into input
+        q = start + string_find_qb(p->input + start, p->len - start);
+        if (q < p->len && p->input[q] == '"')
+        {
+            p->pos = q + 1;
+            return slice_make(p->input + start, q - start);
+        }
     }
     
-    if (p_peek(p) == '.')
+    // Escapes: copy the clean run before each one, decode it, and resume
+    // scanning after it; no byte is looked at twice
+    strbuf_reset(temp);
+    size_t run = start;
+    while (q < p->len && p->input[q] == '\\')
     {
-        p_next(p);
-        if (!isdigit(p_peek(p)))
-            die("bad number fraction");
-        while (p_peek(p) != EOF && isdigit(p_peek(p)))
-            p_next(p);
+        strbuf_append(temp, p->input + run, q - run);
+        run = decode_escape(p->input, p->len, q, temp);
+        q = run + string_find_qb(p->input + run, p->len - run);
     }
+    if (q >= p->len)
+        die("unterminated string");
+    strbuf_append(temp, p->input + run, q - run);
+    p->pos = q + 1;
+    if (!p->strings)
+        return strbuf_slice(temp);
     
-    if (p_peek(p) == 'e' || p_peek(p) == 'E')
-    {
-        p_next(p);
-        if (p_peek(p) == '+' || p_peek(p) == '-')
-            p_next(p);
-        if (!isdigit(p_peek(p)))
-            die("bad number exponent");
-        while (p_peek(p) != EOF && isdigit(p_peek(p)))
-            p_next(p);
+    // Copy from temp buffer to arena
+    return slice_make(arena_slice_dup(p->strings, strbuf_slice(temp)), temp->len);
+}
+
+// Length of the run of ASCII digits at s, eight bytes per step: after
+// x ^ '0' a digit byte is 0..9, and adding 0x76 sets the high bit of any byte
+// that is 10 or more. Carries only reach later bytes, past the first miss.
+static size_t swar_digits(const char *s, size_t n)
+{
+    size_t i = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t x;
+        memcpy(&x, s + i, 8);
+        uint64_t t = x ^ 0x3030303030303030ull;
+        uint64_t miss = ((t + 0x7676767676767676ull) | t) & 0x8080808080808080ull;
+        if (miss)
+            return i + (size_t)(__builtin_ctzll(miss) >> 3);
     }
-    
-    // Return slice directly into input buffer
-    return slice_make(p->input + start, p->pos - start);
+#endif
+    while (i < n && (unsigned char)(s[i] - '0') < 10)
+        i++;
+    return i;
 }
 
-static int p_match_kw(Parser *p, const char *kw, size_t kwlen)
+// Value of the 8 ASCII digits at s
+static uint64_t swar_eight(const char *s)
 {
-    if (p->pos + kwlen > p->len)
-        return 0;
-    if (memcmp(p->input + p->pos, kw, kwlen) != 0)
-        return 0;
-    p->pos += kwlen;
-    return 1;
+    uint64_t x;
+    memcpy(&x, s, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = (x & 0x0F0F0F0F0F0F0F0Full) * 2561 >> 8;
+    x = (x & 0x00FF00FF00FF00FFull) * 6553601 >> 16;
+    return (x & 0x0000FFFF0000FFFFull) * 42949672960001ull >> 32;
+#else
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = v * 10 + (uint64_t)(s[i] - '0');
+    return v;
+#endif
 }
 
-static JValue *parse_value(Parser *p, StrBuf *temp);
+// Binary value of a number; is_int if it has no fraction or exponent and
+// fits in int64 (then d holds the same value)
+typedef struct
+{
+    int is_int;
+    int64_t i;
+    double d;
+} JNumber;
 
-static JValue *parse_array(Parser *p, StrBuf *temp)
+// Where number_scan found the parts of a number
+typedef struct
 {
-    p_expect(p, '[');
-    p_skip_ws(p);
-    
-    JValue *arr = jnew(J_ARRAY);
-    
-    if (p_peek(p) == ']')
+    const char *run[2];     // mantissa digits: integer part, fraction
+    size_t nrun[2];
+    long exp10;             // exponent, less the fraction digits
+    int neg, is_int;
+} NumParts;
+
+// Length of the JSON number at s, or 0 with *err set
+static size_t number_scan(const char *s, size_t len, NumParts *np, const char **err)
+{
+    size_t i = 0;
+    np->neg = len && s[0] == '-';
+    i += (size_t)np->neg;
+
+    np->run[0] = s + i;
+    size_t n = swar_digits(s + i, len - i);
+    if (!n)
     {
-        p_next(p);
-        return arr;
+        *err = "bad number";
+        return 0;
     }
-    
-    while (1)
+    np->nrun[0] = s[i] == '0' ? 1 : n;
+    i += np->nrun[0];
+    np->run[1] = s + i;
+    np->nrun[1] = 0;
+    np->is_int = 1;
+    np->exp10 = 0;
+
+    if (i < len && s[i] == '.')
     {
-        p_skip_ws(p);
-        JValue *item = parse_value(p, temp);
-        jarray_push(arr, item);
-        p_skip_ws(p);
-        
-        if (p_peek(p) == ',')
+        i++;
+        np->run[1] = s + i;
+        np->nrun[1] = swar_digits(s + i, len - i);
+        if (!np->nrun[1])
         {
-            p_next(p);
-            continue;
+            *err = "bad number fraction";
+            return 0;
         }
-        if (p_peek(p) == ']')
+        i += np->nrun[1];
+        np->is_int = 0;
+    }
+
+    if (i < len && (s[i] == 'e' || s[i] == 'E'))
+    {
+        i++;
+        int eneg = i < len && s[i] == '-';
+        if (i < len && (s[i] == '+' || s[i] == '-'))
+            i++;
+        n = swar_digits(s + i, len - i);
+        if (!n)
         {
-            p_next(p);
-            break;
+            *err = "bad number exponent";
+            return 0;
         }
-        die("bad array syntax");
+        long e = 0;
+        for (size_t k = 0; k < n; k++)
+            if (e < 100000)
+                e = e * 10 + (s[i + k] - '0');
+        np->exp10 = eneg ? -e : e;
+        np->is_int = 0;
+        i += n;
     }
-    
-    return arr;
+    np->exp10 -= (long)np->nrun[1];
+    return i;
 }
 
-static JValue *parse_object(Parser *p, StrBuf *temp)
+// Value of the number text scanned into np. Up to 19 significant digits
+// with a power of ten up to 22 is exact in double arithmetic (Clinger's
+// fast path); anything longer goes to strtod.
+static void number_convert(StrSlice s, const NumParts *np, JNumber *out)
 {
-    p_expect(p, '{');
-    p_skip_ws(p);
-    
-    JValue *obj = jnew(J_OBJECT);
-    
-    if (p_peek(p) == '}')
-    {
-        p_next(p);
-        return obj;
-    }
-    
-    while (1)
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    long exp10 = np->exp10;
+    int neg = np->neg;
+
+    if (np->nrun[0] + np->nrun[1] <= 19)
     {
-        p_skip_ws(p);
-        if (p_peek(p) != '"')
-            die("object key must be string");
-        
-        StrSlice key = parse_string(p, temp);
-        p_skip_ws(p);
-        p_expect(p, ':');
-        p_skip_ws(p);
-        
-        JValue *value = parse_value(p, temp);
-        jobject_add(obj, key, value);
-        
-        p_skip_ws(p);
-        if (p_peek(p) == ',')
+        uint64_t m = 0;
+        for (int r = 0; r < 2; r++)
         {
-            p_next(p);
-            continue;
+            const char *run = np->run[r];
+            size_t k = 0;
+            for (; k + 8 <= np->nrun[r]; k += 8)
+                m = m * 100000000u + swar_eight(run + k);
+            for (; k < np->nrun[r]; k++)
+                m = m * 10 + (uint64_t)(run[k] - '0');
         }
-        if (p_peek(p) == '}')
+        if (np->is_int && m <= (uint64_t)INT64_MAX + neg)
         {
-            p_next(p);
-            break;
+            out->is_int = 1;
+            out->i = neg ? (int64_t)(0 - m) : (int64_t)m;
+            out->d = (double)out->i;
+            return;
+        }
+        if (m <= (1ull << 53) && exp10 >= -22 && exp10 <= 22)
+        {
+            double d = (double)m;
+            d = exp10 < 0 ? d / pow10[-exp10] : d * pow10[exp10];
+            out->is_int = 0;
+            out->d = neg ? -d : d;
+            return;
         }
-        die("bad object syntax");
     }
-    
-    return obj;
+
+    // Slow path: correctly rounded by the C library
+    char small[64];
+    char *buf = s.len < sizeof small ? small : (char*)malloc(s.len + 1);
+    if (!buf) die("out of memory");
+    memcpy(buf, s.ptr, s.len);
+    buf[s.len] = '\0';
+    out->is_int = 0;
+    out->d = strtod(buf, NULL);
+    if (buf != small)
+        free(buf);
+}
+
+// Validate a number against the JSON grammar and return its text; with num,
+// also its value, converted from the digit runs the scan already found
+static StrSlice parse_number(Parser *p, JNumber *num)
+{
+    NumParts np;
+    const char *err;
+    size_t n = number_scan(p->input + p->pos, p->len - p->pos, &np, &err);
+    if (!n)
+        die(err);
+
+    // Return slice directly into input buffer
+    StrSlice text = slice_make(p->input + p->pos, n);
+    p->pos += n;
+    if (num)
+        number_convert(text, &np, num);
+    return text;
+}
+
+// Convert s if it is exactly one JSON number (0 otherwise)
+static int number_value(StrSlice s, JNumber *out)
+{
+    NumParts np;
+    const char *err;
+    if (number_scan(s.ptr, s.len, &np, &err) != s.len || !s.len)
+        return 0;
+    number_convert(s, &np, out);
+    return 1;
+}
+
+static int p_match_kw(Parser *p, const char *kw, size_t kwlen)
+{
+    if (p->pos + kwlen > p->len)
+        return 0;
+    if (memcmp(p->input + p->pos, kw, kwlen) != 0)
+        return 0;
+    p->pos += kwlen;
+    return 1;
+}
+
+// Closing quote of the string whose opening quote is at q (no index)
+static size_t scan_string_end(const char *s, size_t len, size_t q)
+{
+    for (;;)
+    {
+        const char *hit = (const char *)memchr(s + q + 1, '"', len - q - 1);
+        if (!hit)
+            die("unterminated string");
+        q = (size_t)(hit - s);
+
+        // Escaped iff preceded by an odd run of backslashes
+        size_t run = 0;
+        while (s[q - 1 - run] == '\\')
+            run++;
+        if (!(run & 1))
+            return q;
+    }
+}
+
+// The parsers keep open containers on an explicit stack instead of the C
+// stack: it starts in the caller's local array and moves to the heap when a
+// record nests deeper. Entering level depth fails past --max-depth.
+static void depth_check(size_t depth)
+{
+    if (depth >= G_opt.max_depth)
+        die("nesting deeper than --max-depth");
+}
+
+static void *depth_push(void *st, void *local, size_t *cap, size_t depth, size_t elem)
+{
+    depth_check(depth);
+    if (depth < *cap)
+        return st;
+    void *grown = st == local ? malloc(*cap * 2 * elem) : realloc(st, *cap * 2 * elem);
+    if (!grown) die("out of memory");
+    if (st == local)
+        memcpy(grown, local, *cap * elem);
+    *cap *= 2;
+    return grown;
+}
+
+static void depth_free(void *st, void *local)
+{
+    if (st != local)
+        free(st);
+}
+
+// Skip past the bracket closing the container p is depth levels inside
+// (depth 0: the container opening at p->pos)
+static void skip_to_close(Parser *p, size_t depth)
+{
+    size_t q = p->pos;
+    while (1)
+    {
+        if (q >= p->len)
+            die("unexpected EOF");
+        char ch = p->input[q];
+        if (ch == '{' || ch == '[')
+            depth++;
+        else if ((ch == '}' || ch == ']') && --depth == 0)
+            break;
+
+        if (p->ix)
+            q = ix_seek(p->ix, q + 1); // string interiors are never tokens
+        else if (ch == '"')
+            q = scan_string_end(p->input, p->len, q) + 1;
+        else
+            q++;
+    }
+    p->pos = q + 1;
 }
 
-static JValue *parse_value(Parser *p, StrBuf *temp)
+// Skip a value checking only that strings and brackets balance. Projection
+// drops unwanted subtrees this way instead of parsing them.
+static void skip_fast(Parser *p)
 {
     p_skip_ws(p);
     int c = p_peek(p);
-    
     if (c == EOF)
         die("unexpected EOF");
+    if (c == ',' || c == ':' || c == '}' || c == ']')
+        die("unknown value");
+
     if (c == '"')
     {
-        JValue *v = jnew(J_STRING);
-        v->as.string = parse_string(p, temp);
-        return v;
+        size_t close = p->ix ? ix_string_end(p->ix, p->pos) : scan_string_end(p->input, p->len, p->pos);
+        p->pos = close + 1;
+        return;
     }
-    if (c == '{')
-        return parse_object(p, temp);
-    if (c == '[')
-        return parse_array(p, temp);
-    if (c == 't')
+
+    if (c != '{' && c != '[')
     {
-        if (!p_match_kw(p, "true", 4))
-            die("bad token");
-        JValue *v = jnew(J_BOOL);
-        v->as.boolean = 1;
-        return v;
+        // A scalar runs up to the next token or whitespace
+        if (p->ix)
+        {
+            p->pos = ix_seek(p->ix, p->pos + 1);
+            return;
+        }
+        while (p->pos < p->len && !isspace((unsigned char)p->input[p->pos]) &&
+               !strchr(",:]}", p->input[p->pos]))
+            p->pos++;
+        return;
     }
-    if (c == 'f')
+
+    skip_to_close(p, 0);
+}
+
+// --------------- Header collection (using slices) ---------------
+
+// Interned column names: keys[] keeps first-seen order (the column id is the
+// index), an open-addressing table maps a key to its id in O(1).
+typedef struct
+{
+    StrSlice *keys;
+    uint64_t *hashes;   // hash of keys[i]
+    size_t len, cap;
+    uint32_t *table;    // id + 1 per slot, 0 = empty
+    size_t tcap;        // power of two
+} KeySet;
+
+#define KEY_NOT_FOUND ((size_t)-1)
+
+static size_t keyset_slot(const KeySet *s, StrSlice k, uint64_t h)
+{
+    size_t mask = s->tcap - 1;
+    size_t i = (size_t)h & mask;
+    while (s->table[i])
     {
-        if (!p_match_kw(p, "false", 5))
-            die("bad token");
-        JValue *v = jnew(J_BOOL);
-        v->as.boolean = 0;
-        return v;
+        uint32_t id = s->table[i] - 1;
+        if (s->hashes[id] == h && slice_eq(s->keys[id], k))
+            break;
+        i = (i + 1) & mask;
     }
-    if (c == 'n')
+    return i;
+}
+
+static void keyset_rehash(KeySet *s, size_t tcap)
+{
+    s->table = (uint32_t *)arena_alloc0(&A_perm, tcap * sizeof(uint32_t), _Alignof(uint32_t));
+    s->tcap = tcap;
+    for (size_t id = 0; id < s->len; id++)
     {
-        if (!p_match_kw(p, "null", 4))
-            die("bad token");
-        return jnew(J_NULL);
+        size_t i = (size_t)s->hashes[id] & (tcap - 1);
+        while (s->table[i])
+            i = (i + 1) & (tcap - 1);
+        s->table[i] = (uint32_t)id + 1;
     }
-    if (c == '-' || isdigit(c))
+}
+
+// Column id of k, or KEY_NOT_FOUND
+static size_t keyset_find(const KeySet *s, StrSlice k)
+{
+    if (!s->tcap)
+        return KEY_NOT_FOUND;
+    size_t i = keyset_slot(s, k, slice_hash(k));
+    return s->table[i] ? (size_t)s->table[i] - 1 : KEY_NOT_FOUND;
+}
+
+static int keyset_contains(const KeySet *s, StrSlice k)
+{
+    return keyset_find(s, k) != KEY_NOT_FOUND;
+}
+
+// Column id of k, interning it at the end of the column order if new
+static size_t keyset_add(KeySet *s, StrSlice k)
+{
+    if (!s->tcap)
+        keyset_rehash(s, 64);
+
+    uint64_t h = slice_hash(k);
+    size_t i = keyset_slot(s, k, h);
+    if (s->table[i])
+        return (size_t)s->table[i] - 1;
+
+    if (s->len == s->cap)
     {
-        JValue *v = jnew(J_NUMBER);
-        v->as.number = parse_number(p);
-        return v;
+        size_t oldcap = s->cap;
+        size_t newcap = oldcap ? oldcap * 2 : 32;
+
+        s->keys = (StrSlice *)arena_grow(
+            &A_perm,
+            s->keys,
+            oldcap * sizeof(StrSlice),
+            newcap * sizeof(StrSlice),
+            _Alignof(StrSlice)
+        );
+        s->hashes = (uint64_t *)arena_grow(
+            &A_perm,
+            s->hashes,
+            oldcap * sizeof(uint64_t),
+            newcap * sizeof(uint64_t),
+            _Alignof(uint64_t)
+        );
+        s->cap = newcap;
     }
-    
-    die("unknown value");
-    return NULL;
+    // stored headers must survive to end => permanent arena
+    size_t id = s->len++;
+    s->keys[id] = slice_make(arena_slice_dup(&A_perm, k), k.len);
+    s->hashes[id] = h;
+    s->table[i] = (uint32_t)id + 1;
+
+    // keep the load factor under 1/2
+    if (s->len * 2 > s->tcap)
+        keyset_rehash(s, s->tcap * 2);
+    return id;
+}
+
+static void keyset_free(KeySet *s)
+{
+    (void)s;
 }
 
-// --------------- Flattening to key/value pairs (using slices) ---------------
+// --------------- Path trie (interned dotted paths) ---------------
+//
+// Every distinct (parent path, member key) pair gets a small integer id, so
+// records with a known shape resolve nested keys with one short-key hash and
+// never build "prefix.key" strings. The dotted column name is built once, the
+// first time a value is emitted at a path, and cached as its column id.
+
+#define PATH_ROOT 0u
+#define PATH_NO_COL UINT32_MAX
 
 typedef struct
 {
-    StrSlice key;
-    StrSlice val; // already stringified for CSV cell
-} KV;
+    uint32_t parent;
+    uint32_t col;       // column id, PATH_NO_COL until first emitted
+    uint8_t proj;       // PROJ_* decision, 0 until first needed
+    uint8_t pred;       // PROJ_TEST: --where column index
+    uint8_t plain;      // key has no '"' or '\\': its input text is the key
+    uint32_t first;     // member the last record had first under this path
+    uint32_t next;      // member that followed this one (PATH_ROOT: none yet)
+    StrSlice key;       // member key (permanent copy)
+    uint64_t hash;
+} PathNode;
 
-typedef struct
+typedef struct PathTrie
 {
-    KV *items;
+    PathNode *nodes;    // nodes[PATH_ROOT] is the record itself
     size_t len, cap;
-} KVList;
+    uint32_t *table;    // id per slot, 0 = empty (the root is never a child)
+    size_t tcap;        // power of two
+    KeySet *headers;
+    StrBuf name;        // scratch for building dotted names
+    uint32_t *chain;    // scratch: a path's ancestors, leaf first
+    size_t chain_cap;
+} PathTrie;
+
+static void path_rehash(PathTrie *t, size_t tcap)
+{
+    t->table = (uint32_t *)arena_alloc0(&A_perm, tcap * sizeof(uint32_t), _Alignof(uint32_t));
+    t->tcap = tcap;
+    for (size_t id = 1; id < t->len; id++)
+    {
+        size_t i = (size_t)t->nodes[id].hash & (tcap - 1);
+        while (t->table[i])
+            i = (i + 1) & (tcap - 1);
+        t->table[i] = (uint32_t)id;
+    }
+}
 
-static void kv_push(KVList *l, StrSlice k, StrSlice v)
+static void path_push(PathTrie *t, uint32_t parent, StrSlice key, uint64_t h)
 {
-    if (l->len == l->cap)
+    if (t->len == t->cap)
     {
-        size_t oldcap = l->cap;
-        size_t newcap = oldcap ? oldcap * 2 : 16;
+        size_t oldcap = t->cap;
+        size_t newcap = oldcap ? oldcap * 2 : 64;
 
-        l->items = (KV *)arena_grow(
-            &A_tmp,
-            l->items,
-            oldcap * sizeof(KV),
-            newcap * sizeof(KV),
-            _Alignof(KV)
+        t->nodes = (PathNode *)arena_grow(
+            &A_perm,
+            t->nodes,
+            oldcap * sizeof(PathNode),
+            newcap * sizeof(PathNode),
+            _Alignof(PathNode)
         );
-        l->cap = newcap;
+        t->cap = newcap;
     }
-    l->items[l->len].key = k;
-    l->items[l->len].val = v;
-    l->len++;
+    PathNode *n = &t->nodes[t->len++];
+    n->parent = parent;
+    n->col = PATH_NO_COL;
+    n->proj = 0;
+    n->pred = 0;
+    n->plain = !memchr(key.ptr, '"', key.len) && !memchr(key.ptr, '\\', key.len);
+    n->first = PATH_ROOT;
+    n->next = PATH_ROOT;
+    n->key = key;
+    n->hash = h;
+}
+
+static void path_init(PathTrie *t, KeySet *headers)
+{
+    *t = (PathTrie){0};
+    t->headers = headers;
+    strbuf_init(&t->name, 256);
+    path_push(t, PATH_ROOT, slice_make("", 0), 0);
+    path_rehash(t, 256);
 }
 
-static StrSlice slice_primitive(const JValue *v)
+static void path_free(PathTrie *t)
 {
-    switch (v->type)
+    strbuf_destroy(&t->name);
+}
+
+// Id of member `key` under `parent`, created on first sight
+static uint32_t path_child(PathTrie *t, uint32_t parent, StrSlice key)
+{
+    uint64_t h = slice_hash(key) ^ ((uint64_t)parent * 0x9E3779B97F4A7C15ull);
+    size_t mask = t->tcap - 1;
+    size_t i = (size_t)h & mask;
+
+    while (t->table[i])
     {
-    case J_NULL:
-        return slice_from_cstr("null");
-    case J_BOOL:
-        return slice_from_cstr(v->as.boolean ? "true" : "false");
-    case J_NUMBER:
-        return v->as.number;
-    case J_STRING:
-        return v->as.string;
-    default:
-        return slice_from_cstr("[complex]");
+        const PathNode *n = &t->nodes[t->table[i]];
+        if (n->hash == h && n->parent == parent && slice_eq(n->key, key))
+            return t->table[i];
+        i = (i + 1) & mask;
+    }
+
+    uint32_t id = (uint32_t)t->len;
+    path_push(t, parent, slice_make(arena_slice_dup(&A_perm, key), key.len), h);
+    t->table[i] = id;
+    if (t->len * 2 > t->tcap)
+        path_rehash(t, t->tcap * 2);
+    return id;
+}
+
+// Key prediction: records almost always repeat the previous record's member
+// order, so each object remembers its first member and each member the one
+// that followed it. The predicted member is confirmed with one compare, and
+// only a miss hashes the key (and, in the parsers, scans it as a string).
+// prev is the member just resolved in this object, PATH_ROOT before the first.
+
+static uint32_t path_guess(const PathTrie *t, uint32_t parent, uint32_t prev)
+{
+    return prev == PATH_ROOT ? t->nodes[parent].first : t->nodes[prev].next;
+}
+
+// Path of member `key` under `parent`, following *prev
+static uint32_t path_next_child(PathTrie *t, uint32_t parent, uint32_t *prev, StrSlice key)
+{
+    uint32_t guess = path_guess(t, parent, *prev);
+    uint32_t child = guess;
+    if (guess == PATH_ROOT || !slice_eq(t->nodes[guess].key, key))
+    {
+        child = path_child(t, parent, key);
+        if (*prev == PATH_ROOT)
+            t->nodes[parent].first = child;
+        else
+            t->nodes[*prev].next = child;
+    }
+    *prev = child;
+    return child;
+}
+
+// Path of the member key at p->pos (a '"'), following *prev; *key is its
+// text. A predicted plain key is matched against the raw input and skipped
+// without parse_string.
+static uint32_t p_member(Parser *p, PathTrie *t, uint32_t parent, uint32_t *prev,
+                         StrBuf *temp, StrSlice *key)
+{
+    uint32_t guess = path_guess(t, parent, *prev);
+    if (guess != PATH_ROOT)
+    {
+        const PathNode *n = &t->nodes[guess];
+        size_t at = p->pos + 1;
+        if (n->plain && at + n->key.len < p->len && p->input[at + n->key.len] == '"' &&
+            memcmp(p->input + at, n->key.ptr, n->key.len) == 0)
+        {
+            p->pos = at + n->key.len + 1;
+            *key = slice_make(p->input + at, n->key.len);
+            *prev = guess;
+            return guess;
+        }
+    }
+    *key = parse_string(p, temp);
+    return path_next_child(t, parent, prev, *key);
+}
+
+// Dotted name of a path, in t->name (valid until the next call)
+static StrSlice path_name(PathTrie *t, uint32_t id)
+{
+    // Walk up to the root, then append keys top-down like make_key did:
+    // "prefix.key", or just "key" while the prefix is still empty
+    size_t depth = 0;
+    for (uint32_t at = id; at != PATH_ROOT; at = t->nodes[at].parent)
+    {
+        if (depth == t->chain_cap)
+        {
+            size_t newcap = t->chain_cap ? t->chain_cap * 2 : 64;
+            t->chain = (uint32_t *)arena_grow(
+                &A_perm,
+                t->chain,
+                t->chain_cap * sizeof(uint32_t),
+                newcap * sizeof(uint32_t),
+                _Alignof(uint32_t)
+            );
+            t->chain_cap = newcap;
+        }
+        t->chain[depth++] = at;
     }
+
+    strbuf_reset(&t->name);
+    while (depth--)
+    {
+        if (t->name.len)
+            strbuf_push(&t->name, '.');
+        strbuf_append_slice(&t->name, t->nodes[t->chain[depth]].key);
+    }
+    return strbuf_slice(&t->name);
+}
+
+// Column id of a path; the dotted name is built and interned only once
+static uint32_t path_col(PathTrie *t, uint32_t id)
+{
+    PathNode *n = &t->nodes[id];
+    if (n->col == PATH_NO_COL)
+        n->col = (uint32_t)keyset_add(t->headers, path_name(t, id));
+    return n->col;
+}
+
+static KeySet G_proj_cols;      // --columns, in output order
+static KeySet G_proj_prefixes;  // "a" and "a.b" for a requested "a.b.c"
+
+// --------------- Row filter (--where) ---------------
+//
+// Predicates on column values, ANDed. Each is tested as soon as the first
+// value of its column is parsed (the path node is flagged PROJ_TEST), and a
+// failing record is abandoned right there: the rest of it is only skipped
+// and nothing of it reaches flattening or the CSV writer. A record without
+// the column fails, and only scalar values compare (an array never matches).
+
+typedef enum
+{
+    W_EQ,       // a=x
+    W_NE,       // a!=x
+    W_PREFIX,   // a^=x
+    W_IN,       // a in x,y,z
+    W_LT,       // a<n  (numeric)
+    W_LE,       // a<=n
+    W_GT,       // a>n
+    W_GE        // a>=n
+} WhereOp;
+
+typedef struct
+{
+    size_t col;         // index in G_where_cols
+    WhereOp op;
+    StrSlice *vals;     // W_IN: alternatives, otherwise vals[0]
+    size_t nvals;
+    JNumber bound;      // numeric ops
+} Where;
+
+#define WHERE_MAX_COLS 64
+
+static Where *G_where;
+static size_t G_nwhere;
+static KeySet G_where_cols;     // distinct filtered columns
+static uint64_t G_where_all;    // one bit per filtered column
+
+// Numeric value of a bound or a string cell: JSON numbers through
+// number_value, anything else strtod accepts in full (" 12", "0x1p3")
+static int slice_to_number(StrSlice s, JNumber *out)
+{
+    if (number_value(s, out))
+        return 1;
+    char buf[64];
+    if (s.len == 0 || s.len >= sizeof buf)
+        return 0;
+    memcpy(buf, s.ptr, s.len);
+    buf[s.len] = '\0';
+    char *end;
+    out->is_int = 0;
+    out->d = strtod(buf, &end);
+    return end == buf + s.len;
+}
+
+static void where_add(const char *expr)
+{
+    static const struct { const char *tok; WhereOp op; } ops[] = {
+        {"!=", W_NE}, {"^=", W_PREFIX}, {"<=", W_LE}, {">=", W_GE},
+        {"==", W_EQ}, {"=", W_EQ}, {"<", W_LT}, {">", W_GT},
+    };
+
+    // The operator that comes first wins, so values may contain " in "
+    // or symbols: "title=sign in page", "tags in a=b,c"
+    Where w = {0};
+    const char *op = expr + strcspn(expr, "!^<>=");
+    const char *in = strstr(expr, " in ");
+    size_t oplen = 4;
+    w.op = W_IN;
+    if (in && in < op)
+        op = in;
+    else
+    {
+        size_t k = 0;
+        for (; k < sizeof ops / sizeof ops[0]; k++)
+            if (strncmp(op, ops[k].tok, strlen(ops[k].tok)) == 0)
+                break;
+        if (!*op || k == sizeof ops / sizeof ops[0])
+            die("bad --where predicate");
+        w.op = ops[k].op;
+        oplen = strlen(ops[k].tok);
+    }
+    if (op == expr)
+        die("bad --where predicate");
+
+    StrSlice col = slice_make(expr, (size_t)(op - expr));
+    w.col = keyset_add(&G_where_cols, col);
+    if (w.col >= WHERE_MAX_COLS)
+        die("too many --where columns");
+    G_where_all |= (uint64_t)1 << w.col;
+
+    // Prefixes must be descended into even when they are not output
+    for (size_t i = 0; i < col.len; i++)
+        if (col.ptr[i] == '.')
+            keyset_add(&G_proj_prefixes, slice_make(col.ptr, i));
+
+    const char *rhs = op + oplen;
+    size_t n = 1;
+    if (w.op == W_IN)
+        for (const char *c = rhs; *c; c++)
+            n += *c == ',';
+    w.vals = (StrSlice *)arena_alloc(&A_perm, n * sizeof(StrSlice), _Alignof(StrSlice));
+    for (const char *at = rhs;; )
+    {
+        size_t len = w.op == W_IN ? strcspn(at, ",") : strlen(at);
+        w.vals[w.nvals++] = slice_make(at, len);
+        if (!at[len])
+            break;
+        at += len + 1;
+    }
+    if (w.op >= W_LT && !slice_to_number(w.vals[0], &w.bound))
+        die("--where range bound must be a number");
+
+    G_where = (Where *)realloc(G_where, (G_nwhere + 1) * sizeof(Where));
+    if (!G_where) die("cannot allocate predicates");
+    G_where[G_nwhere++] = w;
+}
+
+// num: v's value when the parser has already converted it (a JSON number)
+static int where_match(const Where *w, StrSlice v, const JNumber *num)
+{
+    JNumber x;
+    int c;
+    switch (w->op)
+    {
+    case W_EQ:
+        return slice_eq(v, w->vals[0]);
+    case W_NE:
+        return !slice_eq(v, w->vals[0]);
+    case W_PREFIX:
+        return v.len >= w->vals[0].len && memcmp(v.ptr, w->vals[0].ptr, w->vals[0].len) == 0;
+    case W_IN:
+        for (size_t i = 0; i < w->nvals; i++)
+            if (slice_eq(v, w->vals[i]))
+                return 1;
+        return 0;
+    default:
+        if (num)
+            x = *num;
+        else if (!slice_to_number(v, &x))
+            return 0;
+        // Integers compare exactly, also past 2^53; NaN matches nothing
+        if (x.is_int && w->bound.is_int)
+            c = (x.i > w->bound.i) - (x.i < w->bound.i);
+        else if (x.d != x.d || w->bound.d != w->bound.d)
+            return 0;
+        else
+            c = (x.d > w->bound.d) - (x.d < w->bound.d);
+        return w->op == W_LT ? c < 0
+             : w->op == W_LE ? c <= 0
+             : w->op == W_GT ? c > 0
+             : c >= 0;
+    }
+}
+
+// Test the first value of filtered column col; *seen tracks the columns
+// tested in the current record; num is the value of a JSON number the parser
+// already converted (NULL otherwise). Returns 0 if the record must be dropped.
+static int where_test(uint64_t *seen, size_t col, StrSlice v, int scalar, const JNumber *num)
+{
+    uint64_t bit = (uint64_t)1 << col;
+    if (*seen & bit)
+        return 1; // a later duplicate: the first value wins
+    *seen |= bit;
+    if (!scalar)
+        return 0;
+    for (size_t i = 0; i < G_nwhere; i++)
+        if (G_where[i].col == col && !where_match(&G_where[i], v, num))
+            return 0;
+    return 1;
+}
+
+// At the end of a record: every filtered column must have been present
+static int where_done(uint64_t seen)
+{
+    return seen == G_where_all;
+}
+
+// --------------- Projection (--columns) ---------------
+//
+// Only the requested columns are materialized. Each path node caches whether
+// its dotted name is a requested column (keep its value), whether it is a
+// proper dotted prefix of one (descend into an object value) and whether a
+// --where predicate tests it; anything else is skipped with skip_fast and
+// never reaches the tape or a row.
+
+#define PROJ_KEEP    1u
+#define PROJ_DESCEND 2u
+#define PROJ_TEST    4u
+#define PROJ_KNOWN   8u
+
+static void proj_init(const char *list)
+{
+    for (const char *at = list;; )
+    {
+        const char *comma = strchr(at, ',');
+        size_t n = comma ? (size_t)(comma - at) : strlen(at);
+        keyset_add(&G_proj_cols, slice_make(at, n));
+        for (size_t i = 0; i < n; i++)
+            if (at[i] == '.')
+                keyset_add(&G_proj_prefixes, slice_make(at, i));
+        if (!comma)
+            break;
+        at = comma + 1;
+    }
+}
+
+// With a projection, the header is the requested columns in order
+static void headers_init(KeySet *headers)
+{
+    for (size_t i = 0; i < G_proj_cols.len; i++)
+        keyset_add(headers, G_proj_cols.keys[i]);
+}
+
+static unsigned path_proj(PathTrie *t, uint32_t id)
+{
+    if (!G_opt.pushdown)
+        return PROJ_KEEP | PROJ_DESCEND;
+
+    PathNode *n = &t->nodes[id];
+    if (!n->proj)
+    {
+        StrSlice name = path_name(t, id);
+        unsigned f = PROJ_KNOWN;
+        if (!G_opt.columns || keyset_contains(&G_proj_cols, name))
+            f |= PROJ_KEEP;
+        // Children of an empty name are not prefixed by "."
+        if (!G_opt.columns || !name.len || keyset_contains(&G_proj_prefixes, name))
+            f |= PROJ_DESCEND;
+        size_t col = keyset_find(&G_where_cols, name);
+        if (col != KEY_NOT_FOUND)
+        {
+            f |= PROJ_TEST;
+            n->pred = (uint8_t)col;
+        }
+        n->proj = (uint8_t)f;
+    }
+    return n->proj;
+}
+
+// Whether a value starting with c and PROJ_* flags f is needed at all
+static int proj_wanted(unsigned f, int c)
+{
+    return (f & (c == '{' ? PROJ_DESCEND : PROJ_KEEP | PROJ_TEST)) != 0;
+}
+
+// --------------- Tape builder ---------------
+
+// A state machine straight onto the tape, with open containers on an
+// explicit stack. Decoded strings come back in temp (p->strings is NULL) and
+// are appended to t->esc. With pushdown (t->proj set) members are resolved
+// to paths as they are parsed and the ones no requested column depends on
+// are skipped; containers inside arrays only render as {...} / [...], so
+// their contents are skipped too.
+// tape_value returns 0 once a --where predicate rejects the record, after
+// skipping the rest of every open container.
+
+static void tape_push_string(Tape *t, StrSlice s, const StrBuf *temp)
+{
+    if (s.ptr == temp->data)
+    {
+        tape_push_text(t, J_STRING, 1, t->esc.len, s.len);
+        strbuf_append_slice(&t->esc, s);
+    }
+    else
+        tape_push_text(t, J_STRING, 0, (size_t)(s.ptr - t->base), s.len);
+}
+
+// An open container; for an object, also the member being parsed
+typedef struct
+{
+    size_t at;              // tape word opening the container
+    uint32_t path;          // members of an array share the array's path
+    uint8_t is_obj;
+    uint8_t tested;         // the member's value goes through a --where test
+    uint32_t prev;          // pushdown: the last member's path (key prediction)
+    uint32_t child;
+    size_t key_at, val_at;
+    unsigned f;
+} TapeFrame;
+
+enum { TS_VALUE, TS_ITEM, TS_DONE };
+
+static int tape_value(Parser *p, Tape *t, StrBuf *temp, uint32_t path)
+{
+    TapeFrame local[32], *st = local;
+    size_t sp = 0, cap = sizeof local / sizeof local[0];
+    uint32_t vpath = path;
+    int state = TS_VALUE, ok = 1;
+    JNumber num = {0};      // value of a tested member's number
+
+    while (1)
+    {
+        if (state == TS_ITEM)
+        {
+            // A member or element of the top container starts here
+            TapeFrame *fr = &st[sp - 1];
+            p_skip_ws(p);
+            int c = p_peek(p);
+            if (!fr->is_obj)
+            {
+                state = TS_VALUE;
+                vpath = fr->path;
+                if (t->proj && (c == '{' || c == '['))
+                {
+                    skip_fast(p);
+                    tape_close(t, tape_open(t, c == '{' ? J_OBJECT : J_ARRAY));
+                    state = TS_DONE;
+                }
+            }
+            else
+            {
+                if (c != '"')
+                    die("object key must be string");
+
+                StrSlice key;
+                fr->child = PATH_ROOT;
+                fr->f = PROJ_KEEP | PROJ_DESCEND;
+                if (t->proj)
+                {
+                    fr->child = p_member(p, t->proj, fr->path, &fr->prev, temp, &key);
+                    fr->f = path_proj(t->proj, fr->child);
+                }
+                else
+                    key = parse_string(p, temp);
+                p_skip_ws(p);
+                p_expect(p, ':');
+                p_skip_ws(p);
+
+                c = p_peek(p);
+
+                fr->tested = 0;
+                state = TS_DONE;
+                if (!proj_wanted(fr->f, c))
+                    skip_fast(p);
+                else
+                {
+                    fr->key_at = t->len;
+                    tape_push_string(t, key, temp);
+                    fr->val_at = t->len;
+                    fr->tested = (fr->f & PROJ_TEST) && c != '{';
+                    vpath = fr->child;
+                    state = TS_VALUE;
+                }
+            }
+        }
+
+        if (state == TS_VALUE)
+        {
+            p_skip_ws(p);
+            int c = p_peek(p);
+            state = TS_DONE;
+
+            if (c == EOF)
+                die("unexpected EOF");
+            if (c == '{' || c == '[')
+            {
+                st = (TapeFrame*)depth_push(st, local, &cap, sp, sizeof *st);
+                TapeFrame *fr = &st[sp++];
+                fr->is_obj = c == '{';
+                fr->path = vpath;
+                fr->prev = PATH_ROOT;
+                fr->tested = 0;
+                fr->at = tape_open(t, fr->is_obj ? J_OBJECT : J_ARRAY);
+                p_next(p);
+                p_skip_ws(p);
+                if (p_peek(p) == (fr->is_obj ? '}' : ']'))
+                {
+                    p_next(p);
+                    tape_close(t, fr->at);
+                    sp--;
+                }
+                else
+                    state = TS_ITEM;
+            }
+            else if (c == '"')
+                tape_push_string(t, parse_string(p, temp), temp);
+            else if (c == 't')
+            {
+                if (!p_match_kw(p, "true", 4))
+                    die("bad token");
+                tape_push_bool(t, 1);
+            }
+            else if (c == 'f')
+            {
+                if (!p_match_kw(p, "false", 5))
+                    die("bad token");
+                tape_push_bool(t, 0);
+            }
+            else if (c == 'n')
+            {
+                if (!p_match_kw(p, "null", 4))
+                    die("bad token");
+                tape_push(t, (uint64_t)J_NULL << 56);
+            }
+            else if (c == '-' || isdigit(c))
+            {
+                StrSlice text = parse_number(p, sp && st[sp - 1].tested ? &num : NULL);
+                tape_push_text(t, J_NUMBER, 0, (size_t)(text.ptr - t->base), text.len);
+            }
+            else
+                die("unknown value");
+            if (state == TS_ITEM)
+                continue;
+        }
+
+        // TS_DONE: a value (or skipped item) inside the top container ended
+        if (!sp)
+            break;
+        TapeFrame *fr = &st[sp - 1];
+        if (fr->tested)
+        {
+            fr->tested = 0;
+            unsigned type = tape_type(t, fr->val_at);
+            ok = where_test(&t->seen, t->proj->nodes[fr->child].pred,
+                            slice_primitive(t, fr->val_at), type != J_ARRAY,
+                            type == J_NUMBER ? &num : NULL);
+            if (!(fr->f & PROJ_KEEP)) // tested, not output
+                t->len = fr->key_at;
+            if (!ok)
+            {
+                skip_to_close(p, sp);
+                break;
+            }
+        }
+
+        p_skip_ws(p);
+        int c = p_peek(p);
+        if (c == ',')
+        {
+            p_next(p);
+            state = TS_ITEM;
+        }
+        else if (c == (fr->is_obj ? '}' : ']'))
+        {
+            p_next(p);
+            tape_close(t, fr->at);
+            sp--;
+        }
+        else
+            die(fr->is_obj ? "bad object syntax" : "bad array syntax");
+    }
+
+    depth_free(st, local);
+    return ok;
+}
+
+// --------------- Flattening to column cells (using slices) ---------------
+
+// Flattened records, kept between pass 1 and pass 2 so every record is
+// flattened once: cells of row r are [row_end[r-1], row_end[r]), each a
+// column id plus the cell text.
+typedef struct
+{
+    uint32_t *cols;
+    StrSlice *vals;
+    size_t len, cap;        // cells
+    size_t *row_end;
+    size_t nrows, rows_cap;
+    const uint32_t *remap;  // cols are range-local ids: remap[c] is the header id
+} RowStore;
+
+static void rowstore_push(RowStore *rs, size_t col, StrSlice val)
+{
+    if (rs->len == rs->cap)
+    {
+        size_t oldcap = rs->cap;
+        size_t newcap = oldcap ? oldcap * 2 : 1024;
+
+        rs->cols = (uint32_t *)arena_grow(
+            &A_perm,
+            rs->cols,
+            oldcap * sizeof(uint32_t),
+            newcap * sizeof(uint32_t),
+            _Alignof(uint32_t)
+        );
+        rs->vals = (StrSlice *)arena_grow(
+            &A_perm,
+            rs->vals,
+            oldcap * sizeof(StrSlice),
+            newcap * sizeof(StrSlice),
+            _Alignof(StrSlice)
+        );
+        rs->cap = newcap;
+    }
+    rs->cols[rs->len] = (uint32_t)col;
+    rs->vals[rs->len] = val;
+    rs->len++;
+}
+
+static void rowstore_end_row(RowStore *rs)
+{
+    if (rs->nrows == rs->rows_cap)
+    {
+        size_t oldcap = rs->rows_cap;
+        size_t newcap = oldcap ? oldcap * 2 : 256;
+
+        rs->row_end = (size_t *)arena_grow(
+            &A_perm,
+            rs->row_end,
+            oldcap * sizeof(size_t),
+            newcap * sizeof(size_t),
+            _Alignof(size_t)
+        );
+        rs->rows_cap = newcap;
+    }
+    rs->row_end[rs->nrows++] = rs->len;
+}
+
+// Fill a column slot; on duplicate keys the first value wins
+static void row_set(StrSlice *row, size_t col, StrSlice val)
+{
+    if (!row[col].ptr)
+        row[col] = val;
+}
+
+// Scatter row r of the store into column slots
+static void rowstore_fill(const RowStore *rs, size_t r, StrSlice *row, size_t ncols)
+{
+    memset(row, 0, ncols * sizeof(StrSlice));
+    size_t begin = r ? rs->row_end[r - 1] : 0;
+    if (rs->remap)
+        for (size_t i = begin; i < rs->row_end[r]; i++)
+            row_set(row, rs->remap[rs->cols[i]], rs->vals[i]);
+    else
+        for (size_t i = begin; i < rs->row_end[r]; i++)
+            row_set(row, rs->cols[i], rs->vals[i]);
+}
+
+// Flattening resolves each path to its column and appends the cell
+typedef struct
+{
+    PathTrie *paths;
+    RowStore *rows;
+} FlatOut;
+
+static void flat_emit(FlatOut *out, uint32_t path, StrSlice val)
+{
+    rowstore_push(out->rows, path_col(out->paths, path), val);
+}
+
+static int array_is_all_primitives(const Tape *t, size_t arr)
+{
+    size_t end = tape_next(t, arr);
+    for (size_t i = arr + 1; i < end; i = tape_next(t, i))
+    {
+        unsigned type = tape_type(t, i);
+        if (type == J_ARRAY || type == J_OBJECT)
+            return 0;
+    }
+    return 1;
+}
+
+static StrSlice join_array_primitives(const Tape *t, size_t arr, StrBuf *temp)
+{
+    strbuf_reset(temp);
+    
+    size_t end = tape_next(t, arr);
+    for (size_t i = arr + 1; i < end; i = tape_next(t, i))
+    {
+        if (i > arr + 1) strbuf_push(temp, ';');
+        StrSlice s = slice_primitive(t, i);
+        strbuf_append_slice(temp, s);
+    }
+    
+    // Copy to arena for permanence (cells outlive pass 1)
+    return slice_make(arena_slice_dup(&A_perm, strbuf_slice(temp)), temp->len);
+}
+
+static void json_print_value(const Tape *t, size_t i, StrBuf *sb)
+{
+    switch (tape_type(t, i))
+    {
+    case J_NULL:
+        strbuf_append_cstr(sb, "null");
+        break;
+    case J_BOOL:
+        strbuf_append_cstr(sb, tape_bool(t, i) ? "true" : "false");
+        break;
+    case J_NUMBER:
+        strbuf_append_slice(sb, tape_slice(t, i));
+        break;
+    case J_STRING:
+        strbuf_push(sb, '"');
+        strbuf_append_slice(sb, tape_slice(t, i));
+        strbuf_push(sb, '"');
+        break;
+    case J_OBJECT:
+        strbuf_append_cstr(sb, "{...}");
+        break;
+    case J_ARRAY:
+        strbuf_append_cstr(sb, "[...]");
+        break;
+    }
+}
+
+static StrSlice json_array_to_string(const Tape *t, size_t arr, StrBuf *temp)
+{
+    strbuf_reset(temp);
+    strbuf_push(temp, '[');
+    
+    size_t end = tape_next(t, arr);
+    for (size_t i = arr + 1; i < end; i = tape_next(t, i))
+    {
+        if (i > arr + 1) strbuf_push(temp, ',');
+        json_print_value(t, i, temp);
+    }
+    
+    strbuf_push(temp, ']');
+    return slice_make(arena_slice_dup(&A_perm, strbuf_slice(temp)), temp->len);
+}
+
+// An array or primitive member: one cell
+static void flatten_value(const Tape *t, size_t i, uint32_t path, FlatOut *out, StrBuf *temp)
+{
+    if (tape_type(t, i) == J_ARRAY)
+    {
+        if (array_is_all_primitives(t, i))
+        {
+            StrSlice joined = join_array_primitives(t, i, temp);
+            flat_emit(out, path, joined);
+        }
+        else
+        {
+            StrSlice s = json_array_to_string(t, i, temp);
+            flat_emit(out, path, s);
+        }
+        return;
+    }
+    // primitive
+    flat_emit(out, path, slice_primitive(t, i));
+}
+
+// An object flatten_object has descended into from its parent
+typedef struct
+{
+    size_t end;             // the parent's end, path and last member
+    uint32_t path, prev;
+} FlatFrame;
+
+// Members of nested objects in tape order; the enclosing objects wait on an
+// explicit stack
+static void flatten_object(const Tape *t, size_t obj, uint32_t path, FlatOut *out, StrBuf *temp)
+{
+    FlatFrame local[32], *st = local;
+    size_t sp = 0, cap = sizeof local / sizeof local[0];
+
+    size_t end = tape_next(t, obj);
+    uint32_t prev = PATH_ROOT;
+    for (size_t i = obj + 1;; )
+    {
+        // A nested object ends where its parent's next member starts
+        while (i == end && sp)
+        {
+            sp--;
+            end = st[sp].end;
+            path = st[sp].path;
+            prev = st[sp].prev;
+        }
+        if (i == end)
+            break;
+
+        StrSlice k = tape_slice(t, i);
+        i = tape_next(t, i);
+        uint32_t child = path_next_child(out->paths, path, &prev, k);
+        if (tape_type(t, i) == J_OBJECT)
+        {
+            // The tape was built within --max-depth, so this never fails
+            st = (FlatFrame*)depth_push(st, local, &cap, sp, sizeof *st);
+            st[sp].end = end;
+            st[sp].path = path;
+            st[sp].prev = prev;
+            sp++;
+            end = tape_next(t, i);
+            path = child;
+            prev = PATH_ROOT;
+            i++;
+            continue;
+        }
+        flatten_value(t, i, child, out, temp);
+        i = tape_next(t, i);
+    }
+
+    depth_free(st, local);
+}
+
+// --------------- Batched output (fwrite-based) ---------------
+//
+// Same writer as io_optimisations/json2csv_fwrite_batch.c: cells are copied
+// into one large user-space buffer that is flushed with fwrite() in big chunks.
+
+typedef struct
+{
+    FILE *f;
+    char *buf;
+    size_t len;
+    size_t cap;
+} OutBuf;
+
+static void out_flush(OutBuf *o);
+
+static void out_init(OutBuf *o, FILE *f, size_t cap)
+{
+    o->f = f;
+    o->buf = (char *)malloc(cap);
+    if (!o->buf)
+        die("out of memory");
+    o->len = 0;
+    o->cap = cap;
+}
+
+// In-memory variant: no file, the buffer grows instead of flushing
+static void out_init_mem(OutBuf *o, size_t cap)
+{
+    out_init(o, NULL, cap);
+}
+
+static void out_reserve(OutBuf *o, size_t n)
+{
+    if (o->len + n <= o->cap)
+        return;
+    size_t cap = o->cap ? o->cap : 4096;
+    while (cap < o->len + n)
+        cap *= 2;
+    char *buf = (char *)realloc(o->buf, cap);
+    if (!buf)
+        die("out of memory");
+    o->buf = buf;
+    o->cap = cap;
+}
+
+static void out_free(OutBuf *o)
+{
+    if (!o)
+        return;
+    out_flush(o);
+    free(o->buf);
+    o->buf = NULL;
+    o->len = o->cap = 0;
+    o->f = NULL;
+}
+
+static void out_flush(OutBuf *o)
+{
+    if (o->len == 0 || !o->f)
+        return;
+    size_t n = fwrite(o->buf, 1, o->len, o->f);
+    if (n != o->len)
+        die("write failed");
+    o->len = 0;
+}
+
+static void out_write_n(OutBuf *o, const char *s, size_t n)
+{
+    if (n == 0)
+        return;
+
+    if (!o->f)
+    {
+        out_reserve(o, n);
+        memcpy(o->buf + o->len, s, n);
+        o->len += n;
+        return;
+    }
+
+    // If the chunk is larger than our whole buffer, flush current buffer and write directly.
+    if (n >= o->cap)
+    {
+        out_flush(o);
+        size_t w = fwrite(s, 1, n, o->f);
+        if (w != n)
+            die("write failed");
+        return;
+    }
+
+    if (o->len + n > o->cap)
+        out_flush(o);
+    memcpy(o->buf + o->len, s, n);
+    o->len += n;
+}
+
+static void out_putc(OutBuf *o, char ch)
+{
+    if (o->len == o->cap)
+    {
+        if (o->f)
+            out_flush(o);
+        else
+            out_reserve(o, 1);
+    }
+    o->buf[o->len++] = ch;
+}
+
+// --------------- CSV writer (using slices) ---------------
+
+// Index of the first byte that forces quoting (, " \n \r), or n.
+// Tests 32 bytes per step; clean cells never leave the vector loop.
+static size_t csv_find_special(const char *s, size_t n)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, quote)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+        uint32_t bits = (uint32_t)_mm256_movemask_epi8(hit);
+        if (bits)
+            return i + (size_t)__builtin_ctz(bits);
+    }
+#elif defined(__SSE2__)
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; i + 32 <= n; i += 32)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        __m128i ha = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(a, comma), _mm_cmpeq_epi8(a, quote)),
+            _mm_or_si128(_mm_cmpeq_epi8(a, lf), _mm_cmpeq_epi8(a, cr)));
+        __m128i hb = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(b, comma), _mm_cmpeq_epi8(b, quote)),
+            _mm_or_si128(_mm_cmpeq_epi8(b, lf), _mm_cmpeq_epi8(b, cr)));
+        uint32_t bits = (uint32_t)_mm_movemask_epi8(ha) |
+                        ((uint32_t)_mm_movemask_epi8(hb) << 16);
+        if (bits)
+            return i + (size_t)__builtin_ctz(bits);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        char c = s[i];
+        if (c == ',' || c == '"' || c == '\n' || c == '\r')
+            return i;
+    }
+    return n;
+}
+
+static void csv_write_slice(OutBuf *out, StrSlice s)
+{
+    size_t first = csv_find_special(s.ptr, s.len);
+    if (first == s.len)
+    {
+        out_write_n(out, s.ptr, s.len);
+        return;
+    }
+    
+    // Quoted: copy the runs between quotes in bulk, doubling each quote
+    out_putc(out, '"');
+    const char *p = s.ptr;
+    const char *end = s.ptr + s.len;
+    out_write_n(out, p, first);
+    p += first;
+    while (p < end)
+    {
+        const char *q = (const char *)memchr(p, '"', (size_t)(end - p));
+        if (!q)
+        {
+            out_write_n(out, p, (size_t)(end - p));
+            break;
+        }
+        out_write_n(out, p, (size_t)(q - p) + 1);
+        out_putc(out, '"'); // escape by doubling
+        p = q + 1;
+    }
+    out_putc(out, '"');
+}
+
+static void csv_write_header(OutBuf *out, const KeySet *headers)
+{
+    for (size_t i = 0; i < headers->len; i++)
+    {
+        if (i)
+            out_putc(out, ',');
+        csv_write_slice(out, headers->keys[i]);
+    }
+    out_putc(out, '\n');
+}
+
+// One CSV line from column slots, missing cells stay empty
+static void csv_write_row(OutBuf *out, const StrSlice *row, size_t ncols)
+{
+    for (size_t c = 0; c < ncols; c++)
+    {
+        if (c)
+            out_putc(out, ',');
+        if (row[c].ptr)
+            csv_write_slice(out, row[c]);
+    }
+    out_putc(out, '\n');
+}
+
+// --------------- Top-level parsing ---------------
+//
+// The records tape holds the top-level objects back to back (the enclosing
+// array is not recorded), so record k+1 starts at tape_next() of record k.
+
+static void parse_ndjson(const char *input, size_t len, StructIndex *ix, StrBuf *temp, Tape *t);
+
+// Parse one top-level value and return its type; an object rejected by
+// --where is rolled back off the tape (and still reported as J_OBJECT)
+static unsigned tape_record(Parser *p, Tape *t, StrBuf *temp)
+{
+    size_t at = t->len;
+    size_t esc = t->esc.len;
+    t->seen = 0;
+    if (tape_value(p, t, temp, PATH_ROOT))
+    {
+        unsigned type = tape_type(t, at);
+        if (type != J_OBJECT || where_done(t->seen))
+            return type;
+    }
+    t->len = at;
+    t->esc.len = esc;
+    return J_OBJECT;
+}
+
+// One element of the top array, which must be an object
+static void parse_record(Parser *p, Tape *t, StrBuf *temp)
+{
+    if (tape_record(p, t, temp) != J_OBJECT)
+        die("top array must contain objects");
+}
+
+// Parse the input onto t, which the caller has initialized
+static void parse_top(const char *input, size_t len, StructIndex *ix, StrBuf *temp, Tape *t)
+{
+    if (G_opt.ndjson)
+    {
+        parse_ndjson(input, len, ix, temp, t);
+        return;
+    }
+
+    Parser p;
+    p_init(&p, input, len);
+    p.strings = NULL;
+    p_attach_index(&p, ix);
+    p_skip_ws(&p);
+
+    int c = p_peek(&p);
+    if (c != '[')
+    {
+        // A lone object is the only record; report syntax errors before the shape
+        if (tape_record(&p, t, temp) != J_OBJECT)
+            die("top-level JSON must be object or array of objects");
+        return;
+    }
+
+    p_next(&p);
+    p_skip_ws(&p);
+    if (p_peek(&p) == ']')
+        return;
+
+    while (1)
+    {
+        parse_record(&p, t, temp);
+        p_skip_ws(&p);
+
+        if (p_peek(&p) == ',')
+        {
+            p_next(&p);
+            continue;
+        }
+        if (p_peek(&p) == ']')
+            break;
+        die("bad array syntax");
+    }
+}
+
+// --------------- NDJSON input (one record per line) ---------------
+//
+// Each non-blank line is parsed on its own, with the parser bounded to the
+// line, so record boundaries are just newlines (memchr) and lines can be
+// handed to different threads without any structural pre-pass.
+
+// Next non-blank line [*begin, *end) at or after *pos; 0 at end of input
+static int ndjson_next_line(const char *input, size_t len, size_t *pos,
+                            size_t *begin, size_t *end)
+{
+    while (*pos < len)
+    {
+        const char *nl = (const char *)memchr(input + *pos, '\n', len - *pos);
+        size_t b = *pos;
+        size_t e = nl ? (size_t)(nl - input) : len;
+        *pos = nl ? e + 1 : len;
+
+        while (b < e && isspace((unsigned char)input[b]))
+            b++;
+        if (b < e)
+        {
+            *begin = b;
+            *end = e;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The record must be the only value on its line
+static void ndjson_expect_end(Parser *p)
+{
+    p_skip_ws(p);
+    if (p_peek(p) != EOF)
+        die("trailing data after NDJSON record");
+}
+
+static void parse_ndjson_line(const char *line, size_t n, StructIndex *ix, StrBuf *temp, Tape *t)
+{
+    Parser p;
+    p_init(&p, line, n);
+    p.strings = NULL;
+    p_attach_index(&p, ix);
+
+    if (tape_record(&p, t, temp) != J_OBJECT)
+        die("NDJSON lines must be objects");
+    ndjson_expect_end(&p);
+}
+
+static void parse_ndjson(const char *input, size_t len, StructIndex *ix, StrBuf *temp, Tape *t)
+{
+    size_t pos = 0, b, e;
+    while (ndjson_next_line(input, len, &pos, &b, &e))
+        parse_ndjson_line(input + b, e - b, ix, temp, t);
+}
+
+// --------------- Parallel parsing of the top-level array ---------------
+//
+// A serial walk over the structural index finds top-level element boundaries
+// near evenly spaced offsets (for NDJSON, the next newline is a boundary).
+// Each chunk (a comma separated run of objects, or a run of lines) is parsed
+// on its own thread onto its own tape; the tapes are walked in input order.
+
+typedef struct
+{
+    const char *input;
+    size_t begin, end;  // chunk bytes, between '[' / ',' and ',' / ']'
+    Tape *tape;         // records of this chunk, owned by the caller
+} ParseChunk;
+
+// Returns the number of chunks, or 0 if the input is not a non-empty array.
+static size_t split_top_array(const char *input, size_t len, StructIndex *ix,
+                              ParseChunk *chunks, size_t max_chunks)
+{
+    ix_init(ix, input, len);
+
+    size_t q = ix_seek(ix, 0);
+    if (q >= len || input[q] != '[')
+        return 0;
+    ix->at++;
+
+    // Empty array: nothing to split
+    size_t first = ix_seek(ix, q + 1);
+    if (first < len && input[first] == ']')
+        return 0;
+
+    size_t n = 0;
+    size_t begin = q + 1;
+    size_t depth = 1;
+    while ((q = ix_seek(ix, q + 1)) < len)
+    {
+        char c = input[q];
+        ix->at++;
+        if (c == '{' || c == '[')
+            depth++;
+        else if (c == '}' || c == ']')
+        {
+            if (--depth == 0)
+                break;
+        }
+        else if (c == ',' && depth == 1 && n + 1 < max_chunks &&
+                 q >= len / max_chunks * (n + 1))
+        {
+            chunks[n].begin = begin;
+            chunks[n].end = q;
+            n++;
+            begin = q + 1;
+        }
+    }
+    if (depth != 0)
+        die("unexpected EOF");
+    // Brackets are only counted here; the chunk parsers validate every
+    // record, which leaves the top array's own closer to check
+    if (input[q] != ']')
+        die("bad array syntax");
+
+    chunks[n].begin = begin;
+    chunks[n].end = q;
+    return n + 1;
+}
+
+// NDJSON: cut after the first newline past each evenly spaced offset
+static size_t split_lines(const char *input, size_t len, ParseChunk *chunks, size_t max_chunks)
+{
+    size_t n = 0;
+    size_t begin = 0;
+    for (size_t k = 1; k < max_chunks && begin < len; k++)
+    {
+        size_t target = len / max_chunks * k;
+        if (target < begin)
+            continue;
+        const char *nl = (const char *)memchr(input + target, '\n', len - target);
+        if (!nl)
+            break;
+        chunks[n].begin = begin;
+        chunks[n].end = (size_t)(nl - input) + 1;
+        begin = chunks[n++].end;
+    }
+    if (begin < len)
+    {
+        chunks[n].begin = begin;
+        chunks[n].end = len;
+        n++;
+    }
+    return n;
+}
+
+static void *parse_chunk_worker(void *arg)
+{
+    ParseChunk *c = (ParseChunk*)arg;
+    size_t n = c->end - c->begin;
+
+    StrBuf temp;
+    strbuf_init(&temp, 4096);
+
+    StructIndex *ix = NULL;
+    if (G_opt.use_index)
+    {
+        ix = (StructIndex*)malloc(sizeof *ix);
+        if (!ix) die("cannot allocate structural index");
+    }
+
+    // Projection decisions need a trie; the shared one is not thread safe,
+    // so each worker resolves paths in a private one
+    KeySet names = (KeySet){0};
+    PathTrie proj;
+    if (G_opt.pushdown)
+    {
+        arena_init(&A_perm, 0, G_opt.hugepages);
+        path_init(&proj, &names);
+    }
+
+    tape_init(c->tape, c->input, n, G_opt.pushdown ? &proj : NULL);
+    if (G_opt.ndjson)
+    {
+        parse_ndjson(c->input + c->begin, n, ix, &temp, c->tape);
+    }
+    else
+    {
+        Parser p;
+        p_init(&p, c->input + c->begin, n);
+        p.strings = NULL;
+        p_attach_index(&p, ix);
+        while (1)
+        {
+            parse_record(&p, c->tape, &temp);
+
+            p_skip_ws(&p);
+            if (p_peek(&p) == EOF)
+                break;
+            p_expect(&p, ',');
+        }
+    }
+
+    c->tape->proj = NULL;
+    if (G_opt.pushdown)
+    {
+        path_free(&proj);
+        arena_destroy(&A_perm);
+    }
+    free(ix);
+    strbuf_destroy(&temp);
+    return NULL;
+}
+
+// Parse with up to nthreads workers onto tapes[0..n), returning n; falls back
+// to parse_top (one tape, projected through proj) for a single object. The
+// caller frees the tapes.
+static size_t parse_top_parallel(const char *input, size_t len, size_t nthreads, StructIndex *ix,
+                                 StrBuf *temp, PathTrie *proj, Tape *tapes)
+{
+    StructIndex *split_ix = ix;
+    if (!split_ix && !G_opt.ndjson)
+    {
+        split_ix = (StructIndex*)malloc(sizeof *split_ix);
+        if (!split_ix) die("cannot allocate structural index");
+    }
+
+    ParseChunk *chunks = (ParseChunk*)calloc(nthreads, sizeof *chunks);
+    if (!chunks) die("cannot allocate chunks");
+    size_t n = G_opt.ndjson ? split_lines(input, len, chunks, nthreads)
+                            : split_top_array(input, len, split_ix, chunks, nthreads);
+    if (split_ix != ix)
+        free(split_ix);
+
+    if (n == 0)
+    {
+        free(chunks);
+        tape_init(&tapes[0], input, len, proj);
+        parse_top(input, len, ix, temp, &tapes[0]);
+        return 1;
+    }
+
+    pthread_t *tids = (pthread_t*)malloc(n * sizeof *tids);
+    if (!tids) die("cannot allocate threads");
+    for (size_t i = 0; i < n; i++)
+    {
+        chunks[i].input = input;
+        chunks[i].tape = &tapes[i];
+        if (pthread_create(&tids[i], NULL, parse_chunk_worker, &chunks[i]) != 0)
+            die("cannot create thread");
+    }
+    for (size_t i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    free(chunks);
+    return n;
+}
+
+// --------------- Direct engine (no JSON tree) ---------------
+//
+// Parses records straight into CSV cells: members are flattened while they are
+// parsed (paths resolved through the path trie) and land in a per-column slot
+// of the current row, so no tape is ever built and memory
+// stays O(record + header). The price is a second parse of the input (pass 1
+// collects keys, pass 2 fills rows), unless rows are streamed with a late
+// header (--stream).
+
+typedef struct HeaderPatch HeaderPatch;
+typedef struct PipeBatch PipeBatch;
+
+typedef struct
+{
+    PathTrie *paths;     // interns paths and header columns
+    StrSlice *row;       // pass 2 / stream: one cell per column (NULL ptr = missing)
+    size_t row_cap;      // slots allocated in row
+    HeaderPatch *patch;  // stream: records the width of every row written
+    PipeBatch *batch;    // --pipeline: cells go to the batch, formatted later
+    int verify;          // --schema-cache: check the input against the cached header
+    size_t expect;       // cached columns, in the order to verify
+    size_t nseen;        // columns seen so far (ids below nseen)
+    int stale;           // the cache does not match: stop and rediscover
+    StrBuf joined;       // array rendered as a;b;c
+    StrBuf json;         // array rendered as [..] (used if it has containers)
+    StrBuf esc;          // decode buffer for escaped strings
+    uint64_t seen;       // --where columns tested in this record
+    uint32_t *held_path; // --where: cells held back until the record passes
+    StrSlice *held_val;
+    size_t nheld, held_cap;
+} DirectCtx;
+
+// Parse a primitive and return its CSV rendering; with num, a number's value
+// is converted there too
+static StrSlice parse_scalar(Parser *p, StrBuf *temp, JType *type, JNumber *num)
+{
+    int c = p_peek(p);
+
+    if (c == EOF)
+        die("unexpected EOF");
+    if (c == '"')
+    {
+        *type = J_STRING;
+        return parse_string(p, temp);
+    }
+    if (c == 't')
+    {
+        if (!p_match_kw(p, "true", 4))
+            die("bad token");
+        *type = J_BOOL;
+        return slice_from_cstr("true");
+    }
+    if (c == 'f')
+    {
+        if (!p_match_kw(p, "false", 5))
+            die("bad token");
+        *type = J_BOOL;
+        return slice_from_cstr("false");
+    }
+    if (c == 'n')
+    {
+        if (!p_match_kw(p, "null", 4))
+            die("bad token");
+        *type = J_NULL;
+        return slice_from_cstr("null");
+    }
+    if (c == '-' || isdigit(c))
+    {
+        *type = J_NUMBER;
+        return parse_number(p, num);
+    }
+
+    die("unknown value");
+    return slice_make("", 0);
+}
+
+// Parse and validate a value without building anything; depth containers
+// are already open around it
+static void skip_value(Parser *p, StrBuf *temp, size_t depth)
+{
+    // Close brackets of the open containers
+    char local[64], *st = local;
+    size_t sp = 0, cap = sizeof local;
+
+    do
+    {
+        p_skip_ws(p);
+        int c = p_peek(p);
+        if (c == '{' || c == '[')
+        {
+            depth_check(depth + sp);
+            st = (char*)depth_push(st, local, &cap, sp, 1);
+            st[sp++] = c == '{' ? '}' : ']';
+            p_next(p);
+            p_skip_ws(p);
+            if (p_peek(p) != st[sp - 1])
+            {
+                if (c == '{')
+                {
+                    if (p_peek(p) != '"')
+                        die("object key must be string");
+                    parse_string(p, temp);
+                    p_skip_ws(p);
+                    p_expect(p, ':');
+                }
+                continue;
+            }
+            p_next(p);
+            sp--;
+        }
+        else
+        {
+            JType t;
+            parse_scalar(p, temp, &t, NULL);
+        }
+
+        // Past a value: close finished containers, then the next item
+        while (sp)
+        {
+            char close = st[sp - 1];
+            p_skip_ws(p);
+            if (p_peek(p) == close)
+            {
+                p_next(p);
+                sp--;
+                continue;
+            }
+            if (p_peek(p) != ',')
+                die(close == '}' ? "bad object syntax" : "bad array syntax");
+            p_next(p);
+            if (close == '}')
+            {
+                p_skip_ws(p);
+                if (p_peek(p) != '"')
+                    die("object key must be string");
+                parse_string(p, temp);
+                p_skip_ws(p);
+                p_expect(p, ':');
+            }
+            break;
+        }
+    } while (sp);
+
+    depth_free(st, local);
+}
+
+// Pass 1 interns the column, pass 2 (same input, same columns) fills its slot
+static void patch_note_row(HeaderPatch *hp, size_t ncols);
+static void batch_put(PipeBatch *b, uint32_t col, StrSlice val);
+static void batch_end_row(PipeBatch *b, size_t ncols);
+static Arena *batch_strings(PipeBatch *b);
+
+// Make room for at least n slots; new slots start out missing
+static void direct_grow_row(DirectCtx *d, size_t n)
+{
+    size_t cap = d->row_cap ? d->row_cap : 64;
+    while (cap < n)
+        cap *= 2;
+    d->row = (StrSlice*)realloc(d->row, cap * sizeof(StrSlice));
+    if (!d->row) die("cannot allocate row");
+    memset(d->row + d->row_cap, 0, (cap - d->row_cap) * sizeof(StrSlice));
+    d->row_cap = cap;
+}
+
+static void direct_put(DirectCtx *d, uint32_t path, StrSlice val)
+{
+    uint32_t col = path_col(d->paths, path);
+    // Cached ids are in first-seen order, so each new column must be the next
+    if (d->verify && col >= d->nseen)
+    {
+        if (col == d->nseen && col < d->expect)
+            d->nseen++;
+        else
+            d->stale = 1;
+    }
+    if (d->batch)
+    {
+        batch_put(d->batch, col, val);
+        return;
+    }
+    if (!d->row)
+        return;
+    if (col >= d->row_cap) // stream: a key first seen in this record
+        direct_grow_row(d, (size_t)col + 1);
+    row_set(d->row, col, val);
+}
+
+// A filtered record may still be dropped, and its columns must not enter
+// the header then, so cells wait in the held list until the record passes
+static void direct_emit(DirectCtx *d, uint32_t path, StrSlice val)
+{
+    if (!G_nwhere)
+    {
+        direct_put(d, path, val);
+        return;
+    }
+    if (d->nheld == d->held_cap)
+    {
+        d->held_cap = d->held_cap ? d->held_cap * 2 : 64;
+        d->held_path = (uint32_t*)realloc(d->held_path, d->held_cap * sizeof(uint32_t));
+        d->held_val = (StrSlice*)realloc(d->held_val, d->held_cap * sizeof(StrSlice));
+        if (!d->held_path || !d->held_val) die("cannot allocate held cells");
+    }
+    d->held_path[d->nheld] = path;
+    d->held_val[d->nheld] = val;
+    d->nheld++;
+}
+
+// An array member, inside depth open objects
+static void direct_array(Parser *p, DirectCtx *d, uint32_t path, size_t depth)
+{
+    depth_check(depth);
+    p_expect(p, '[');
+    p_skip_ws(p);
+
+    int all_primitives = 1;
+    strbuf_reset(&d->joined);
+    strbuf_reset(&d->json);
+    strbuf_push(&d->json, '[');
+
+    if (p_peek(p) == ']')
+        p_next(p);
+    else
+    {
+        for (size_t i = 0;; i++)
+        {
+            p_skip_ws(p);
+            if (i)
+            {
+                strbuf_push(&d->joined, ';');
+                strbuf_push(&d->json, ',');
+            }
+
+            int c = p_peek(p);
+            if (c == '{' || c == '[')
+            {
+                all_primitives = 0;
+                if (G_opt.pushdown) // only rendered as {...} / [...]
+                    skip_fast(p);
+                else
+                    skip_value(p, &d->esc, depth + 1);
+                strbuf_append_cstr(&d->json, c == '{' ? "{...}" : "[...]");
+            }
+            else
+            {
+                JType t;
+                StrSlice s = parse_scalar(p, &d->esc, &t, NULL);
+                strbuf_append_slice(&d->joined, s);
+                if (t == J_STRING)
+                    strbuf_push(&d->json, '"');
+                strbuf_append_slice(&d->json, s);
+                if (t == J_STRING)
+                    strbuf_push(&d->json, '"');
+            }
+            p_skip_ws(p);
+
+            if (p_peek(p) == ',')
+            {
+                p_next(p);
+                continue;
+            }
+            if (p_peek(p) == ']')
+            {
+                p_next(p);
+                break;
+            }
+            die("bad array syntax");
+        }
+    }
+    strbuf_push(&d->json, ']');
+
+    // Only pass 2 keeps the rendered cell
+    const StrBuf *cell = all_primitives ? &d->joined : &d->json;
+    if (d->row || d->batch)
+        direct_emit(d, path, slice_make(arena_slice_dup(p->strings, strbuf_slice(cell)), cell->len));
+    else
+        direct_emit(d, path, slice_make("", 0));
+}
+
+// A member whose column a --where predicate tests; 0 if the record fails
+static int direct_tested(Parser *p, DirectCtx *d, uint32_t path, unsigned f, int c, size_t depth)
+{
+    size_t col = d->paths->nodes[path].pred;
+    if (c == '[')
+    {
+        if (!where_test(&d->seen, col, slice_make("", 0), 0, NULL))
+            return 0;
+        if (f & PROJ_KEEP)
+            direct_array(p, d, path, depth);
+        else
+            skip_fast(p);
+        return 1;
+    }
+
+    JType t;
+    JNumber num;
+    StrSlice v = parse_scalar(p, &d->esc, &t, &num);
+    if (!where_test(&d->seen, col, v, 1, t == J_NUMBER ? &num : NULL))
+        return 0;
+    if (f & PROJ_KEEP)
+        direct_emit(d, path, v);
+    return 1;
+}
+
+// The record object; nested objects are entered on an explicit stack
+// (arrays are flat, their containers are skipped). Returns 0 once a
+// --where predicate rejects the record, having skipped to its end.
+typedef struct
+{
+    uint32_t path;
+    uint32_t prev;          // last member's path (key prediction)
+} DirectFrame;
+
+static int direct_object(Parser *p, DirectCtx *d, uint32_t path)
+{
+    DirectFrame local[64], *st = local;
+    size_t sp = 0, cap = sizeof local / sizeof local[0];
+    int ok = 1;
+
+    st = (DirectFrame*)depth_push(st, local, &cap, sp, sizeof *st);
+    st[sp++] = (DirectFrame){path, PATH_ROOT};
+    p_expect(p, '{');
+    p_skip_ws(p);
+    int more = p_peek(p) != '}';
+    if (!more)
+    {
+        p_next(p);
+        sp--;
+    }
+
+    while (sp)
+    {
+        if (more)
+        {
+            p_skip_ws(p);
+            if (p_peek(p) != '"')
+                die("object key must be string");
+
+            StrSlice key;
+            DirectFrame *fr = &st[sp - 1];
+            uint32_t child = p_member(p, d->paths, fr->path, &fr->prev, &d->esc, &key);
+
+            p_skip_ws(p);
+            p_expect(p, ':');
+            p_skip_ws(p);
+
+            int c = p_peek(p);
+            unsigned f = path_proj(d->paths, child);
+            if (!proj_wanted(f, c))
+                skip_fast(p);
+            else if ((f & PROJ_TEST) && c != '{')
+                ok = direct_tested(p, d, child, f, c, sp);
+            else if (c == '{')
+            {
+                st = (DirectFrame*)depth_push(st, local, &cap, sp, sizeof *st);
+                st[sp++] = (DirectFrame){child, PATH_ROOT};
+                p_next(p);
+                p_skip_ws(p);
+                if (p_peek(p) != '}')
+                    continue;
+                p_next(p);
+                sp--;
+            }
+            else if (c == '[')
+                direct_array(p, d, child, sp);
+            else
+            {
+                JType t;
+                direct_emit(d, child, parse_scalar(p, &d->esc, &t, NULL));
+            }
+            if (!ok)
+            {
+                skip_to_close(p, sp);
+                break;
+            }
+        }
+
+        // After a member of the innermost open object
+        p_skip_ws(p);
+        more = p_peek(p) == ',';
+        if (more)
+            p_next(p);
+        else if (p_peek(p) == '}')
+        {
+            p_next(p);
+            sp--;
+        }
+        else
+            die("bad object syntax");
+    }
+
+    depth_free(st, local);
+    return ok;
+}
+
+// Decoded strings live in p->strings: A_tmp, reset after every row, or the
+// batch's arena in --pipeline mode, where they must outlive the record
+static void direct_record(Parser *p, DirectCtx *d, OutBuf *out)
+{
+    ArenaMark mark = arena_mark(p->strings);
+
+    if (d->row)
+        memset(d->row, 0, d->paths->headers->len * sizeof(StrSlice));
+
+    d->seen = 0;
+    d->nheld = 0;
+    if (!direct_object(p, d, PATH_ROOT) || !where_done(d->seen))
+    {
+        arena_reset(p->strings, mark);
+        return;
+    }
+    for (size_t i = 0; i < d->nheld; i++)
+        direct_put(d, d->held_path[i], d->held_val[i]);
+
+    if (d->batch)
+    {
+        batch_end_row(d->batch, d->paths->headers->len);
+        return;
+    }
+    if (d->row)
+        csv_write_row(out, d->row, d->paths->headers->len);
+    if (d->patch)
+        patch_note_row(d->patch, d->paths->headers->len);
+
+    arena_reset(p->strings, mark);
+}
+
+// One NDJSON line (or one framed record), parsed on its own
+static void direct_line(const char *line, size_t n, StructIndex *ix, DirectCtx *d, OutBuf *out)
+{
+    Parser p;
+    p_init(&p, line, n);
+    p.strings = d->batch ? batch_strings(d->batch) : &A_tmp;
+    p_attach_index(&p, ix);
+    p_skip_ws(&p);
+    if (p_peek(&p) != '{')
+        die(G_opt.ndjson ? "NDJSON lines must be objects" : "top array must contain objects");
+    direct_record(&p, d, out);
+    ndjson_expect_end(&p);
+}
+
+// One parse over the input: collects headers if d->row is NULL, else writes rows
+static void direct_pass(const char *input, size_t len, StructIndex *ix, DirectCtx *d, OutBuf *out)
+{
+    Parser p;
+    if (G_opt.ndjson)
+    {
+        size_t pos = 0, b, e;
+        while (!d->stale && ndjson_next_line(input, len, &pos, &b, &e))
+            direct_line(input + b, e - b, ix, d, out);
+        return;
+    }
+
+    p_init(&p, input, len);
+    p.strings = &A_tmp; // decoded strings only live until the row is written
+    p_attach_index(&p, ix);
+    p_skip_ws(&p);
+
+    int c = p_peek(&p);
+    if (c == '{')
+    {
+        direct_record(&p, d, out);
+        return;
+    }
+    if (c != '[')
+        die("top-level JSON must be object or array of objects");
+
+    p_next(&p);
+    p_skip_ws(&p);
+    if (p_peek(&p) == ']')
+        return;
+
+    while (1)
+    {
+        p_skip_ws(&p);
+        if (p_peek(&p) != '{')
+            die("top array must contain objects");
+        direct_record(&p, d, out);
+        if (d->stale)
+            return;
+        p_skip_ws(&p);
+
+        if (p_peek(&p) == ',')
+        {
+            p_next(&p);
+            continue;
+        }
+        if (p_peek(&p) == ']')
+            break;
+        die("bad array syntax");
+    }
+}
+
+// --------------- Schema cache (--schema-cache) ---------------
+//
+// The header found by pass 1 is saved, and a later run with the same options
+// writes it straight away and skips pass 1. Pass 2 then checks that this
+// input would have produced the same header: every column must first appear
+// in cached order, no unknown key may appear, and every cached column must be
+// used. Otherwise the output is rewound and the run falls back to both passes.
+//
+// File: "json2csv-schema 1 <options hash> <names hash> <count>\n", then one
+// "<len>:<name>\n" per column.
+
+static uint64_t schema_names_hash(const KeySet *headers)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < headers->len; i++)
+        h = (h ^ slice_hash(headers->keys[i])) * 0x100000001b3ull;
+    return h;
+}
+
+// Add the cached columns to headers; 0 (headers untouched) if the file is
+// missing, damaged or was written for other options
+static int schema_load(const char *path, KeySet *headers)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    StrBuf file;
+    strbuf_init(&file, 4096);
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof chunk, f)) > 0)
+        strbuf_append(&file, chunk, n);
+    fclose(f);
+    strbuf_push(&file, '\0');
+
+    int ok = 0;
+    unsigned long long key, names;
+    size_t count;
+    int at = 0;
+    StrSlice *cols = NULL;
+    if (sscanf(file.data, "json2csv-schema 1 %llx %llx %zu\n%n", &key, &names, &count, &at) == 3
+        && at > 0 && key == G_opt.schema_key && count < file.len)
+    {
+        cols = (StrSlice*)malloc((count + 1) * sizeof(StrSlice));
+        const char *q = file.data + at, *end = file.data + file.len - 1;
+        size_t i = 0;
+        for (; cols && i < count; i++)
+        {
+            char *colon;
+            unsigned long long len = strtoull(q, &colon, 10);
+            if (colon == q || *colon != ':' || len > (size_t)(end - colon - 1)
+                || colon[1 + len] != '\n')
+                break;
+            cols[i] = slice_make(colon + 1, (size_t)len);
+            q = colon + 2 + len;
+        }
+        if (cols && i == count && q == end)
+        {
+            KeySet check = (KeySet){0};
+            for (i = 0; i < count; i++)
+                keyset_add(&check, cols[i]);
+            if (check.len == count && schema_names_hash(&check) == names)
+            {
+                for (i = 0; i < count; i++)
+                    keyset_add(headers, cols[i]);
+                ok = headers->len == count;
+            }
+            keyset_free(&check);
+        }
+    }
+    free(cols);
+    strbuf_destroy(&file);
+    return ok;
+}
+
+// Written next to the target and renamed over it, so readers never see half a file
+static void schema_save(const char *path, const KeySet *headers)
+{
+    size_t plen = strlen(path);
+    char *tmp = (char*)malloc(plen + 5);
+    if (!tmp) die("out of memory");
+    memcpy(tmp, path, plen);
+    memcpy(tmp + plen, ".tmp", 5);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) die("cannot write schema cache");
+    fprintf(f, "json2csv-schema 1 %llx %llx %zu\n", (unsigned long long)G_opt.schema_key,
+            (unsigned long long)schema_names_hash(headers), headers->len);
+    for (size_t i = 0; i < headers->len; i++)
+    {
+        fprintf(f, "%zu:", headers->keys[i].len);
+        fwrite(headers->keys[i].ptr, 1, headers->keys[i].len, f);
+        fputc('\n', f);
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+        die("cannot write schema cache");
+    free(tmp);
+}
+
+// Throw away everything written so far
+static void out_rewind(OutBuf *out)
+{
+    out->len = 0;
+    if (ftruncate(fileno(out->f), 0) < 0 || fseeko(out->f, 0, SEEK_SET) < 0)
+        die("cannot rewind output");
+}
+
+static void run_direct(const char *input, size_t len, StructIndex *ix, OutBuf *out)
+{
+    KeySet headers = (KeySet){0};
+    headers_init(&headers);
+    PathTrie paths;
+    path_init(&paths, &headers);
+    DirectCtx d = {0};
+    d.paths = &paths;
+    strbuf_init(&d.joined, 256);
+    strbuf_init(&d.json, 256);
+    strbuf_init(&d.esc, 256);
+
+    // Single pass with the cached header; columns given by --columns are
+    // first regardless of the input, so verification starts after them
+    int discover = 1;
+    if (G_opt.schema_cache && schema_load(G_opt.schema_cache, &headers))
+    {
+        d.verify = 1;
+        d.expect = headers.len;
+        d.nseen = G_proj_cols.len;
+        csv_write_header(out, &headers);
+        direct_grow_row(&d, headers.len + 1);
+        direct_pass(input, len, ix, &d, out);
+        discover = d.stale || d.nseen != d.expect;
+    }
+    if (discover && d.verify)
+    {
+        out_rewind(out);
+        path_free(&paths);
+        keyset_free(&headers);
+        headers = (KeySet){0};
+        headers_init(&headers);
+        path_init(&paths, &headers);
+        free(d.row);
+        d.row = NULL;
+        d.row_cap = 0;
+        d.verify = 0;
+        d.stale = 0;
+    }
+
+    if (discover)
+    {
+        // Pass 1: collect headers
+        direct_pass(input, len, ix, &d, out);
+        csv_write_header(out, &headers);
+        if (G_opt.schema_cache)
+            schema_save(G_opt.schema_cache, &headers);
+
+        // Pass 2: output rows
+        direct_grow_row(&d, headers.len + 1);
+        direct_pass(input, len, ix, &d, out);
+    }
+
+    free(d.row);
+    strbuf_destroy(&d.joined);
+    strbuf_destroy(&d.json);
+    strbuf_destroy(&d.esc);
+    free(d.held_path);
+    free(d.held_val);
+    path_free(&paths);
+    keyset_free(&headers);
+}
+
+// --------------- Streaming input window (pipes) ---------------
+//
+// Input that cannot be mapped (stdin, a pipe) is read through a refillable
+// window when streaming, instead of being loaded whole. Each record is framed
+// before it is parsed: a quote-aware bracket scan (or the next newline for
+// NDJSON) refills the window, growing it if one record does not fit, until
+// the whole record is inside. No string can then straddle a refill, so every
+// slice stays a zero-copy view until the row is written, and consumed bytes
+// are only dropped by the next refill. Memory is O(window + largest record).
+
+enum { WIN_START, WIN_NEXT, WIN_DONE };
+
+typedef struct
+{
+    int fd;             // -1: the window is the whole input, already in memory
+    char *buf;
+    size_t cap;
+    size_t begin;       // first unconsumed byte
+    size_t len;         // bytes in buf
+    int eof;
+    int state;          // WIN_*: position in the top-level value
+} InWindow;
+
+static void win_init(InWindow *w, int fd, size_t cap)
+{
+    w->fd = fd;
+    w->buf = (char*)malloc(cap);
+    if (!w->buf) die("cannot allocate input window");
+    w->cap = cap;
+    w->begin = w->len = 0;
+    w->eof = 0;
+    w->state = WIN_START;
+}
+
+// A window over input already in memory; it never refills, so records framed
+// in it stay put
+static void win_init_mem(InWindow *w, const char *input, size_t len)
+{
+    w->fd = -1;
+    w->buf = (char*)input;
+    w->cap = w->len = len;
+    w->begin = 0;
+    w->eof = 1;
+    w->state = WIN_START;
+}
+
+static void win_free(InWindow *w)
+{
+    if (w->fd >= 0)
+        free(w->buf);
+    w->buf = NULL;
+}
+
+// Drop consumed bytes and read more (growing the window if it is full of
+// one record); returns 0 at end of input. Invalidates slices into the window.
+static int win_fill(InWindow *w)
+{
+    if (w->eof)
+        return 0;
+    if (w->begin)
+    {
+        memmove(w->buf, w->buf + w->begin, w->len - w->begin);
+        w->len -= w->begin;
+        w->begin = 0;
+    }
+    if (w->len == w->cap)
+    {
+        w->cap *= 2;
+        w->buf = (char*)realloc(w->buf, w->cap);
+        if (!w->buf) die("cannot grow input window");
+    }
+
+    ssize_t n;
+    do
+        n = read(w->fd, w->buf + w->len, w->cap - w->len);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+        die("read failed");
+    if (n == 0)
+    {
+        w->eof = 1;
+        return 0;
+    }
+    w->len += (size_t)n;
+    return 1;
+}
+
+// Consume whitespace; the next byte, or EOF
+static int win_peek(InWindow *w)
+{
+    for (;;)
+    {
+        while (w->begin < w->len && isspace((unsigned char)w->buf[w->begin]))
+            w->begin++;
+        if (w->begin < w->len)
+            return (unsigned char)w->buf[w->begin];
+        if (!win_fill(w))
+            return EOF;
+    }
+}
+
+// Length of the container starting at w->begin, refilling until it is complete
+static size_t win_frame(InWindow *w)
+{
+    size_t off = 0, depth = 0;
+    int in_string = 0;
+    for (;;)
+    {
+        const char *s = w->buf + w->begin;
+        size_t avail = w->len - w->begin;
+        while (off < avail)
+        {
+            char ch = s[off++];
+            if (in_string)
+            {
+                if (ch == '\\')
+                {
+                    if (off == avail) // escaped byte not read yet
+                    {
+                        off--;
+                        break;
+                    }
+                    off++;
+                }
+                else if (ch == '"')
+                    in_string = 0;
+            }
+            else if (ch == '"')
+                in_string = 1;
+            else if (ch == '{' || ch == '[')
+                depth++;
+            else if ((ch == '}' || ch == ']') && --depth == 0)
+                return off;
+        }
+        if (!win_fill(w))
+            die(in_string ? "unterminated string" : "unexpected EOF");
+    }
+}
+
+// Length of the line at w->begin, without its newline
+static size_t win_frame_line(InWindow *w)
+{
+    size_t off = 0;
+    for (;;)
+    {
+        const char *s = w->buf + w->begin;
+        size_t avail = w->len - w->begin;
+        const char *nl = (const char *)memchr(s + off, '\n', avail - off);
+        if (nl)
+            return (size_t)(nl - s);
+        off = avail;
+        if (!win_fill(w))
+            return avail;
+    }
+}
+
+static int win_next_frame(InWindow *w, size_t *n);
+
+// Frame the next record: it is the *n bytes at w->buf + w->begin, which the
+// caller consumes (begin += n) before asking again. 0 once the input is done.
+static int win_next(InWindow *w, size_t *n)
+{
+    if (!win_next_frame(w, n))
+        return 0;
+    if (G_opt.validate_utf8 && w->fd >= 0) // in-memory input is checked up front
+        utf8_validate(w->buf + w->begin, *n);
+    return 1;
+}
+
+static int win_next_frame(InWindow *w, size_t *n)
+{
+    if (G_opt.ndjson)
+    {
+        if (win_peek(w) == EOF)
+            return 0;
+        *n = win_frame_line(w);
+        return 1;
+    }
+
+    int c;
+    switch (w->state)
+    {
+    case WIN_START:
+        c = win_peek(w);
+        if (c == EOF)
+            die("unexpected EOF");
+        if (c == '{')
+        {
+            w->state = WIN_DONE;
+            *n = win_frame(w);
+            return 1;
+        }
+        if (c != '[')
+            die("top-level JSON must be object or array of objects");
+        w->begin++;
+        if (win_peek(w) == ']')
+        {
+            w->state = WIN_DONE;
+            return 0;
+        }
+        break;
+    case WIN_NEXT:
+        c = win_peek(w);
+        if (c == ']')
+        {
+            w->state = WIN_DONE;
+            return 0;
+        }
+        if (c != ',')
+            die(c == EOF ? "unexpected EOF" : "bad array syntax");
+        w->begin++;
+        break;
+    case WIN_DONE:
+        return 0;
+    }
+
+    if (win_peek(w) != '{')
+        die("top array must contain objects");
+    w->state = WIN_NEXT;
+    *n = win_frame(w);
+    return 1;
+}
+
+// direct_pass over a window: frame a record, parse it in place, move on
+static void window_pass(InWindow *w, StructIndex *ix, DirectCtx *d, OutBuf *out)
+{
+    size_t n;
+    while (win_next(w, &n))
+    {
+        direct_line(w->buf + w->begin, n, ix, d, out);
+        w->begin += n;
+    }
+}
+
+// --------------- Late header patching (single-pass streaming) ---------------
+//
+// Rows are written as soon as their record is parsed, using the columns seen
+// so far, behind a gap reserved for the header. Because columns are numbered
+// in first-seen order, a new key only ever appends columns, so earlier rows
+// just lack trailing empty cells. At the end one sequential fix-up pass writes
+// the header into the gap, pads the short rows with commas and closes the gap.
+
+typedef struct
+{
+    size_t rows;
+    size_t ncols;       // width of every row in this run
+} PatchEpoch;
+
+struct HeaderPatch
+{
+    int fd;
+    size_t reserve;     // bytes kept free for the header at offset 0
+    PatchEpoch *epochs;
+    size_t n, cap;
+};
+
+static void patch_begin(HeaderPatch *hp, OutBuf *out, size_t reserve)
+{
+    *hp = (HeaderPatch){0};
+    hp->reserve = reserve;
+
+    int fd = fileno(out->f);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        die("--stream needs a seekable output file");
+
+    // The fix-up reads the body back; "> file" redirections are write-only,
+    // so reopen the same file for reading and writing
+    hp->fd = fd;
+    if ((fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDWR)
+    {
+        char path[64];
+        snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+        hp->fd = open(path, O_RDWR);
+        if (hp->fd < 0)
+            die("--stream cannot read back the output; use -o FILE");
+    }
+
+    if (ftruncate(hp->fd, 0) < 0 || fseeko(out->f, (off_t)reserve, SEEK_SET) < 0)
+        die("cannot reserve header space in output");
+}
+
+static void patch_note_row(HeaderPatch *hp, size_t ncols)
+{
+    if (hp->n && hp->epochs[hp->n - 1].ncols == ncols)
+    {
+        hp->epochs[hp->n - 1].rows++;
+        return;
+    }
+    if (hp->n == hp->cap)
+    {
+        hp->cap = hp->cap ? hp->cap * 2 : 16;
+        hp->epochs = (PatchEpoch *)realloc(hp->epochs, hp->cap * sizeof(PatchEpoch));
+        if (!hp->epochs) die("out of memory");
+    }
+    hp->epochs[hp->n++] = (PatchEpoch){.rows = 1, .ncols = ncols};
+}
+
+// Commas that turn a row of ncols cells into one of final cells
+static size_t patch_pad(size_t ncols, size_t final)
+{
+    if (final <= ncols)
+        return 0;
+    return final - (ncols ? ncols : 1); // an empty line already is one cell
+}
+
+static void patch_pread(int fd, char *buf, size_t n, size_t off)
+{
+    while (n)
+    {
+        ssize_t r = pread(fd, buf, n, (off_t)off);
+        if (r <= 0) die("read back of output failed");
+        buf += r; n -= (size_t)r; off += (size_t)r;
+    }
+}
+
+static void patch_pwrite(int fd, const char *buf, size_t n, size_t off)
+{
+    while (n)
+    {
+        ssize_t w = pwrite(fd, buf, n, (off_t)off);
+        if (w <= 0) die("write failed");
+        buf += w; n -= (size_t)w; off += (size_t)w;
+    }
+}
+
+static void patch_finish(HeaderPatch *hp, OutBuf *out, const KeySet *headers)
+{
+    out_flush(out);
+    fflush(out->f);
+
+    int fd = hp->fd;
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end < 0) die("cannot seek output");
+    size_t body = (size_t)end > hp->reserve ? (size_t)end - hp->reserve : 0;
+
+    OutBuf hdr;
+    out_init_mem(&hdr, 4096);
+    csv_write_header(&hdr, headers);
+
+    size_t final = headers->len;
+    size_t pad_total = 0;
+    size_t pad_rows = 0; // leading rows that need padding (columns only grow)
+    for (size_t e = 0; e < hp->n; e++)
+    {
+        size_t pad = patch_pad(hp->epochs[e].ncols, final);
+        pad_total += hp->epochs[e].rows * pad;
+        if (pad)
+            pad_rows += hp->epochs[e].rows;
+    }
+
+    enum { BLK = 1u << 20 };
+    char *buf = (char *)malloc(BLK);
+    OutBuf w;
+    out_init_mem(&w, BLK + 4096);
+    if (!buf) die("out of memory");
+
+    // Header and padding outgrew the gap: move the body up, back to front
+    size_t src = hp->reserve;
+    if (hdr.len + pad_total > src)
+    {
+        size_t delta = hdr.len + pad_total - src;
+        for (size_t left = body; left > 0;)
+        {
+            size_t n = left < BLK ? left : BLK;
+            left -= n;
+            patch_pread(fd, buf, n, src + left);
+            patch_pwrite(fd, buf, n, src + delta + left);
+        }
+        src += delta;
+    }
+
+    // Front to back: the write offset never passes the read offset, since
+    // header + padding fit in the gap
+    patch_pwrite(fd, hdr.buf, hdr.len, 0);
+    size_t dst = hdr.len;
+    size_t e = 0, row_in_epoch = 0;
+    int in_quotes = 0;
+    size_t done = 0;
+    while (done < body)
+    {
+        size_t n = body - done < BLK ? body - done : BLK;
+        patch_pread(fd, buf, n, src + done);
+        done += n;
+
+        if (pad_rows == 0)
+        {
+            patch_pwrite(fd, buf, n, dst);
+            dst += n;
+            continue;
+        }
+
+        // Row by row while short rows remain: a row ends at a newline outside quotes
+        size_t i = 0;
+        while (i < n && pad_rows)
+        {
+            size_t start = i;
+            while (i < n && (buf[i] != '\n' || in_quotes))
+            {
+                if (buf[i] == '"')
+                    in_quotes = !in_quotes;
+                i++;
+            }
+            out_write_n(&w, buf + start, i - start);
+            if (i == n)
+                break; // row continues in the next block
+
+            size_t pad = patch_pad(hp->epochs[e].ncols, final);
+            for (size_t k = 0; k < pad; k++)
+                out_putc(&w, ',');
+            out_putc(&w, '\n');
+            i++;
+            pad_rows--;
+            if (++row_in_epoch == hp->epochs[e].rows)
+            {
+                e++;
+                row_in_epoch = 0;
+            }
+        }
+        out_write_n(&w, buf + i, n - i);
+        patch_pwrite(fd, w.buf, w.len, dst);
+        dst += w.len;
+        w.len = 0;
+    }
+
+    if (ftruncate(fd, (off_t)dst) < 0 || fseeko(out->f, (off_t)dst, SEEK_SET) < 0)
+        die("cannot finalize output");
+    if (fd != fileno(out->f))
+        close(fd);
+
+    free(buf);
+    out_free(&w);
+    out_free(&hdr);
+    free(hp->epochs);
+    hp->epochs = NULL;
+}
+
+// --------------- Pipeline (--pipeline) ---------------
+//
+// --stream split over four threads joined by single-producer/single-consumer
+// rings: the reader (main thread) frames records into batches, the parser
+// resolves them into (column, cell) lists, the formatter renders CSV text
+// and the writer owns the OutBuf and the header patch bookkeeping. A fixed
+// set of batches circulates, writer back to reader, so memory stays bounded
+// and reading and writing overlap with parsing and formatting.
+
+#define PIPE_BATCHES 8
+#define PIPE_RING 16                    // ring slots: power of two, > PIPE_BATCHES
+#define PIPE_BATCH_BYTES (256u << 10)   // input bytes per batch
+
+struct PipeBatch
+{
+    StrBuf text;        // reader: records copied out of a refilling window
+    const char *base;   // records are at base + rec_off[i]: text or the input
+    size_t *rec_off, *rec_len;
+    size_t nrec, rec_cap;
+    Arena strs;         // parser: decoded strings and rendered arrays
+    uint32_t *cols;     // parser: cells of all rows, in record order
+    StrSlice *vals;
+    size_t ncells, cell_cap;
+    size_t *row_end;    // cells of row r end at row_end[r]
+    size_t *row_ncols;  // header width when row r was parsed
+    size_t nrows, row_cap;
+    OutBuf csv;         // formatter: the rows as CSV text
+};
+
+static Arena *batch_strings(PipeBatch *b) { return &b->strs; }
+
+static void batch_add_record(PipeBatch *b, size_t off, size_t len)
+{
+    if (b->nrec == b->rec_cap)
+    {
+        b->rec_cap = b->rec_cap ? b->rec_cap * 2 : 256;
+        b->rec_off = (size_t*)realloc(b->rec_off, b->rec_cap * sizeof(size_t));
+        b->rec_len = (size_t*)realloc(b->rec_len, b->rec_cap * sizeof(size_t));
+        if (!b->rec_off || !b->rec_len) die("cannot allocate batch");
+    }
+    b->rec_off[b->nrec] = off;
+    b->rec_len[b->nrec] = len;
+    b->nrec++;
+}
+
+static void batch_put(PipeBatch *b, uint32_t col, StrSlice val)
+{
+    if (b->ncells == b->cell_cap)
+    {
+        b->cell_cap = b->cell_cap ? b->cell_cap * 2 : 1024;
+        b->cols = (uint32_t*)realloc(b->cols, b->cell_cap * sizeof(uint32_t));
+        b->vals = (StrSlice*)realloc(b->vals, b->cell_cap * sizeof(StrSlice));
+        if (!b->cols || !b->vals) die("cannot allocate batch");
+    }
+    b->cols[b->ncells] = col;
+    b->vals[b->ncells] = val;
+    b->ncells++;
+}
+
+static void batch_end_row(PipeBatch *b, size_t ncols)
+{
+    if (b->nrows == b->row_cap)
+    {
+        b->row_cap = b->row_cap ? b->row_cap * 2 : 256;
+        b->row_end = (size_t*)realloc(b->row_end, b->row_cap * sizeof(size_t));
+        b->row_ncols = (size_t*)realloc(b->row_ncols, b->row_cap * sizeof(size_t));
+        if (!b->row_end || !b->row_ncols) die("cannot allocate batch");
+    }
+    b->row_end[b->nrows] = b->ncells;
+    b->row_ncols[b->nrows] = ncols;
+    b->nrows++;
+}
+
+static void batch_free(PipeBatch *b)
+{
+    strbuf_destroy(&b->text);
+    free(b->rec_off);
+    free(b->rec_len);
+    arena_destroy(&b->strs);
+    free(b->cols);
+    free(b->vals);
+    free(b->row_end);
+    free(b->row_ncols);
+    out_free(&b->csv);
 }
 
-static int array_is_all_primitives(const JValue *arr)
+// Lock-free SPSC ring of batch pointers; head and tail only ever grow
+typedef struct
 {
-    for (size_t i = 0; i < arr->as.array.len; i++)
-    {
-        JType t = arr->as.array.items[i]->type;
-        if (!(t == J_NULL || t == J_BOOL || t == J_NUMBER || t == J_STRING))
-            return 0;
-    }
-    return 1;
-}
+    _Alignas(64) _Atomic size_t head;   // next slot to pop (consumer)
+    _Alignas(64) _Atomic size_t tail;   // next slot to push (producer)
+    _Alignas(64) PipeBatch *slot[PIPE_RING];
+} SpscRing;
 
-static StrSlice join_array_primitives(const JValue *arr, StrBuf *temp)
+// Spin briefly, then give the core away (the other stages may share it)
+static void spsc_wait(unsigned *spins)
 {
-    strbuf_reset(temp);
-    
-    for (size_t i = 0; i < arr->as.array.len; i++)
-    {
-        if (i > 0) strbuf_push(temp, ';');
-        StrSlice s = slice_primitive(arr->as.array.items[i]);
-        strbuf_append_slice(temp, s);
-    }
-    
-    // Copy to arena for permanence
-    return slice_make(arena_slice_dup(&A_tmp, strbuf_slice(temp)), temp->len);
+    if (++*spins > 64)
+        sched_yield();
 }
 
-static void flatten_value(const JValue *v, StrSlice prefix, KVList *out, StrBuf *temp);
+static void spsc_push(SpscRing *r, PipeBatch *b)
+{
+    size_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned spins = 0;
+    while (t - atomic_load_explicit(&r->head, memory_order_acquire) == PIPE_RING)
+        spsc_wait(&spins);
+    r->slot[t & (PIPE_RING - 1)] = b;
+    atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+}
 
-static StrSlice make_key(StrSlice prefix, StrSlice k, StrBuf *temp)
+static PipeBatch *spsc_pop(SpscRing *r)
 {
-    if (prefix.len == 0)
-    {
-        // Just duplicate k into arena
-        return slice_make(arena_slice_dup(&A_tmp, k), k.len);
-    }
-    
-    strbuf_reset(temp);
-    strbuf_append_slice(temp, prefix);
-    strbuf_push(temp, '.');
-    strbuf_append_slice(temp, k);
-    
-    return slice_make(arena_slice_dup(&A_tmp, strbuf_slice(temp)), temp->len);
+    size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned spins = 0;
+    while (atomic_load_explicit(&r->tail, memory_order_acquire) == h)
+        spsc_wait(&spins);
+    PipeBatch *b = r->slot[h & (PIPE_RING - 1)];
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+    return b;
 }
 
-static void flatten_object(const JValue *obj, StrSlice prefix, KVList *out, StrBuf *temp)
+// A NULL batch marks the end of the stream
+typedef struct
+{
+    SpscRing to_parse, to_format, to_write, free;
+    DirectCtx *d;
+    StructIndex *ix;
+    Arena *perm;        // the main thread's A_perm, lent to the parser
+    OutBuf *out;
+} Pipeline;
+
+static void *pipe_parser(void *arg)
 {
-    for (size_t i = 0; i < obj->as.object.len; i++)
+    Pipeline *pl = (Pipeline*)arg;
+    DirectCtx *d = pl->d;
+
+    // Headers and paths are interned here; keep them in the caller's arena
+    A_perm = *pl->perm;
+    PipeBatch *b;
+    while ((b = spsc_pop(&pl->to_parse)))
     {
-        StrSlice k = obj->as.object.members[i].key;
-        const JValue *val = obj->as.object.members[i].value;
-        StrSlice nk = make_key(prefix, k, temp);
-        flatten_value(val, nk, out, temp);
+        arena_reset(&b->strs, (ArenaMark){0});
+        b->ncells = b->nrows = 0;
+        d->batch = b;
+        for (size_t i = 0; i < b->nrec; i++)
+            direct_line(b->base + b->rec_off[i], b->rec_len[i], pl->ix, d, NULL);
+        spsc_push(&pl->to_format, b);
     }
+    d->batch = NULL;
+    *pl->perm = A_perm;
+    spsc_push(&pl->to_format, NULL);
+    return NULL;
 }
 
-static StrSlice json_array_to_string(const JValue *arr, StrBuf *temp);
-
-static void json_print_value(const JValue *v, StrBuf *sb)
+static void *pipe_formatter(void *arg)
 {
-    switch (v->type)
+    Pipeline *pl = (Pipeline*)arg;
+    // Never NULL, so rows with no columns still memset a valid pointer
+    size_t row_cap = 64;
+    StrSlice *row = (StrSlice*)malloc(row_cap * sizeof(StrSlice));
+    if (!row) die("cannot allocate row");
+    PipeBatch *b;
+    while ((b = spsc_pop(&pl->to_format)))
     {
-    case J_NULL:
-        strbuf_append_cstr(sb, "null");
-        break;
-    case J_BOOL:
-        strbuf_append_cstr(sb, v->as.boolean ? "true" : "false");
-        break;
-    case J_NUMBER:
-        strbuf_append_slice(sb, v->as.number);
-        break;
-    case J_STRING:
-        strbuf_push(sb, '"');
-        strbuf_append_slice(sb, v->as.string);
-        strbuf_push(sb, '"');
-        break;
-    case J_OBJECT:
-        strbuf_append_cstr(sb, "{...}");
-        break;
-    case J_ARRAY:
-        strbuf_append_cstr(sb, "[...]");
-        break;
+        b->csv.len = 0;
+        for (size_t r = 0, i = 0; r < b->nrows; r++)
+        {
+            size_t ncols = b->row_ncols[r];
+            if (ncols > row_cap)
+            {
+                row_cap = ncols * 2;
+                row = (StrSlice*)realloc(row, row_cap * sizeof(StrSlice));
+                if (!row) die("cannot allocate row");
+            }
+            memset(row, 0, ncols * sizeof(StrSlice));
+            for (; i < b->row_end[r]; i++)
+                row_set(row, b->cols[i], b->vals[i]);
+            csv_write_row(&b->csv, row, ncols);
+        }
+        spsc_push(&pl->to_write, b);
     }
+    free(row);
+    spsc_push(&pl->to_write, NULL);
+    return NULL;
 }
 
-static StrSlice json_array_to_string(const JValue *arr, StrBuf *temp)
+static void *pipe_writer(void *arg)
 {
-    strbuf_reset(temp);
-    strbuf_push(temp, '[');
-    
-    for (size_t i = 0; i < arr->as.array.len; i++)
+    Pipeline *pl = (Pipeline*)arg;
+    PipeBatch *b;
+    while ((b = spsc_pop(&pl->to_write)))
     {
-        if (i) strbuf_push(temp, ',');
-        json_print_value(arr->as.array.items[i], temp);
+        out_write_n(pl->out, b->csv.buf, b->csv.len);
+        if (pl->d->patch)
+            for (size_t r = 0; r < b->nrows; r++)
+                patch_note_row(pl->d->patch, b->row_ncols[r]);
+        spsc_push(&pl->free, b);
     }
-    
-    strbuf_push(temp, ']');
-    return slice_make(arena_slice_dup(&A_tmp, strbuf_slice(temp)), temp->len);
+    return NULL;
 }
 
-static void flatten_value(const JValue *v, StrSlice prefix, KVList *out, StrBuf *temp)
+// window_pass on four threads; the calling thread is the reader
+static void pipeline_pass(InWindow *w, StructIndex *ix, DirectCtx *d, OutBuf *out)
 {
-    if (v->type == J_OBJECT)
+    Pipeline pl;
+    memset(&pl, 0, sizeof pl);
+    pl.d = d;
+    pl.ix = ix;
+    pl.perm = &A_perm;
+    pl.out = out;
+
+    PipeBatch batches[PIPE_BATCHES];
+    memset(batches, 0, sizeof batches);
+    for (size_t k = 0; k < PIPE_BATCHES; k++)
     {
-        flatten_object(v, prefix, out, temp);
-        return;
+        strbuf_init(&batches[k].text, w->fd >= 0 ? PIPE_BATCH_BYTES : 16);
+        arena_init(&batches[k].strs, 0, G_opt.hugepages);
+        out_init_mem(&batches[k].csv, PIPE_BATCH_BYTES);
+        spsc_push(&pl.free, &batches[k]);
     }
-    if (v->type == J_ARRAY)
+
+    pthread_t th[3];
+    void *(*stage[3])(void *) = {pipe_parser, pipe_formatter, pipe_writer};
+    for (int k = 0; k < 3; k++)
+        if (pthread_create(&th[k], NULL, stage[k], &pl) != 0)
+            die("cannot create pipeline thread");
+
+    // Records framed in a refilling window move on the next refill, so they
+    // are copied into the batch; an in-memory window is referenced in place
+    int copy = w->fd >= 0;
+    PipeBatch *b = spsc_pop(&pl.free);
+    b->nrec = 0;
+    strbuf_reset(&b->text);
+    size_t bytes = 0, n;
+    while (win_next(w, &n))
     {
-        if (array_is_all_primitives(v))
+        if (copy)
         {
-            StrSlice joined = join_array_primitives(v, temp);
-            kv_push(out, prefix, joined);
+            batch_add_record(b, b->text.len, n);
+            strbuf_append(&b->text, w->buf + w->begin, n);
         }
         else
+            batch_add_record(b, w->begin, n);
+        w->begin += n;
+        bytes += n;
+        if (bytes >= PIPE_BATCH_BYTES)
         {
-            StrSlice s = json_array_to_string(v, temp);
-            kv_push(out, prefix, s);
+            b->base = copy ? b->text.data : w->buf;
+            spsc_push(&pl.to_parse, b);
+            b = spsc_pop(&pl.free);
+            b->nrec = 0;
+            strbuf_reset(&b->text);
+            bytes = 0;
         }
-        return;
     }
-    // primitive
-    kv_push(out, prefix, slice_primitive(v));
+    b->base = copy ? b->text.data : w->buf;
+    spsc_push(&pl.to_parse, b);
+    spsc_push(&pl.to_parse, NULL);
+
+    for (int k = 0; k < 3; k++)
+        pthread_join(th[k], NULL);
+    for (size_t k = 0; k < PIPE_BATCHES; k++)
+        batch_free(&batches[k]);
 }
 
-static void kvlist_free(KVList *l)
+// Single pass: rows go out as records arrive, the header is patched in at the
+// end. Reads from win when it is set, else from the whole input in memory.
+static void run_stream(const char *input, size_t len, InWindow *win, StructIndex *ix, OutBuf *out)
 {
-    (void)l;
+    KeySet headers = (KeySet){0};
+    headers_init(&headers);
+    PathTrie paths;
+    path_init(&paths, &headers);
+    HeaderPatch patch;
+    patch_begin(&patch, out, G_opt.header_reserve);
+
+    DirectCtx d = {0};
+    d.paths = &paths;
+    d.patch = &patch;
+    if (!G_opt.pipeline) // pipeline rows are assembled by the formatter
+        direct_grow_row(&d, 64);
+    strbuf_init(&d.joined, 256);
+    strbuf_init(&d.json, 256);
+    strbuf_init(&d.esc, 256);
+
+    if (G_opt.pipeline)
+    {
+        InWindow mem;
+        if (!win)
+        {
+            win_init_mem(&mem, input, len);
+            win = &mem;
+        }
+        pipeline_pass(win, ix, &d, out);
+    }
+    else if (win)
+        window_pass(win, ix, &d, out);
+    else
+        direct_pass(input, len, ix, &d, out);
+    patch_finish(&patch, out, &headers);
+
+    free(d.row);
+    strbuf_destroy(&d.joined);
+    strbuf_destroy(&d.json);
+    strbuf_destroy(&d.esc);
+    free(d.held_path);
+    free(d.held_val);
+    path_free(&paths);
+    keyset_free(&headers);
 }
 
-// --------------- Header collection (using slices) ---------------
+// --------------- Parallel header discovery (pass 1) ---------------
+//
+// With several tapes (--threads), each is flattened on its own thread into a
+// private path trie, header set and row store. Tape k holds records that all
+// follow those of tape k-1, so the sequential first-seen column order is the
+// range-local orders concatenated in tape order with repeats dropped: the
+// merge interns them in that order, and each store keeps a local-to-header
+// id table that pass 2 applies while scattering cells.
 
 typedef struct
 {
-    StrSlice *keys;
-    size_t len, cap;
-} KeySet;
+    const Tape *tape;
+    KeySet headers;     // columns of this range, first-seen order
+    PathTrie paths;
+    RowStore rows;      // column ids are local until remapped
+    Arena *perm;        // names, rows and rendered arrays; outlives the thread
+} FlattenChunk;
 
-static int keyset_contains(const KeySet *s, StrSlice k)
+static void *flatten_chunk_worker(void *arg)
 {
-    for (size_t i = 0; i < s->len; i++)
+    FlattenChunk *c = (FlattenChunk*)arg;
+    A_perm = *c->perm;
+    StrBuf temp;
+    strbuf_init(&temp, 4096);
+    headers_init(&c->headers);
+    path_init(&c->paths, &c->headers);
+
+    FlatOut fo = {.paths = &c->paths, .rows = &c->rows};
+    const Tape *t = c->tape;
+    for (size_t i = 0; i < t->len; i = tape_next(t, i))
     {
-        if (slice_eq(s->keys[i], k))
-            return 1;
+        flatten_object(t, i, PATH_ROOT, &fo, &temp);
+        rowstore_end_row(&c->rows);
     }
-    return 0;
+
+    path_free(&c->paths);
+    strbuf_destroy(&temp);
+    *c->perm = A_perm;
+    return NULL;
 }
 
-static void keyset_add(KeySet *s, StrSlice k)
+// Pass 1 over ntapes tapes on as many threads: stores[k] gets tape k's rows,
+// arenas[k] the memory behind them, headers the merged columns
+static void flatten_parallel(const Tape *tapes, size_t ntapes, KeySet *headers,
+                             RowStore *stores, Arena *arenas)
 {
-    if (keyset_contains(s, k))
-        return;
+    FlattenChunk *chunks = (FlattenChunk*)calloc(ntapes, sizeof *chunks);
+    pthread_t *th = (pthread_t*)calloc(ntapes, sizeof *th);
+    if (!chunks || !th) die("cannot allocate header workers");
 
-    if (s->len == s->cap)
+    for (size_t k = 0; k < ntapes; k++)
     {
-        size_t oldcap = s->cap;
-        size_t newcap = oldcap ? oldcap * 2 : 32;
+        arena_init(&arenas[k], 1u << 20, G_opt.hugepages);
+        chunks[k].tape = &tapes[k];
+        chunks[k].perm = &arenas[k];
+        if (pthread_create(&th[k], NULL, flatten_chunk_worker, &chunks[k]) != 0)
+            die("cannot create header worker");
+    }
+    for (size_t k = 0; k < ntapes; k++)
+        pthread_join(th[k], NULL);
 
-        s->keys = (StrSlice *)arena_grow(
-            &A_perm,
-            s->keys,
-            oldcap * sizeof(StrSlice),
-            newcap * sizeof(StrSlice),
-            _Alignof(StrSlice)
-        );
-        s->cap = newcap;
+    for (size_t k = 0; k < ntapes; k++)
+    {
+        const KeySet *local = &chunks[k].headers;
+        uint32_t *remap = (uint32_t*)arena_alloc(&A_perm, (local->len + 1) * sizeof(uint32_t), _Alignof(uint32_t));
+        for (size_t j = 0; j < local->len; j++)
+            remap[j] = (uint32_t)keyset_add(headers, local->keys[j]);
+        stores[k] = chunks[k].rows;
+        stores[k].remap = remap;
+        keyset_free(&chunks[k].headers);
     }
-    // stored headers must survive to end => permanent arena
-    s->keys[s->len++] = slice_make(arena_slice_dup(&A_perm, k), k.len);
+    free(chunks);
+    free(th);
 }
 
-static void keyset_free(KeySet *s)
+// --------------- Parallel row formatting (pass 2) ---------------
+//
+// Once the header is known every row formats independently. Rows are cut
+// into tasks of roughly FMT_TASK_CELLS column slots, and tasks are handed out
+// in rounds of FMT_ROUND_TASKS per worker: each worker owns a contiguous task
+// range, takes from its front and, when empty, steals the back half of the
+// fullest range. The calling thread commits the task buffers in row order
+// and only publishes the next round once the current one is written, so
+// buffered CSV text stays bounded by one round.
+// Publishing stores one range per worker, so it is gated: the committer
+// raises `publishing` and waits for thieves already inside a steal to leave,
+// and thieves stay out while it is up (both sides seq_cst, so one of them
+// sees the other). A steal therefore never sees half a round.
+
+#define FMT_TASK_CELLS (1u << 16)
+#define FMT_ROUND_TASKS 8
+
+typedef struct
 {
-    (void)s;
-}
+    const RowStore *rows;
+    size_t row_begin, row_end;
+    OutBuf buf;
+    _Atomic int done;
+} FmtTask;
 
-// --------------- CSV writer (using slices) ---------------
+typedef struct
+{
+    _Alignas(64) _Atomic uint64_t range;  // owned tasks: lo in high half, hi in low
+} FmtRange;
+
+typedef struct
+{
+    size_t ncols;
+    size_t nworkers;
+    FmtRange *ranges;   // one per worker
+    FmtTask *tasks;     // one round; task k lives in slot k % round
+    size_t round;
+    _Atomic int publishing; // a round's ranges are being stored
+    _Atomic int stealers;   // workers inside the steal section
+    _Atomic int finished;
+} FmtPool;
 
-static void csv_write_slice(FILE *out, StrSlice s)
+typedef struct
 {
-    // Check if needs quoting
-    int need_quote = 0;
-    for (size_t i = 0; i < s.len; i++)
+    FmtPool *pool;
+    size_t self;
+    uint32_t priv_lo, priv_hi; // stolen tasks that could not be published
+} FmtWorker;
+
+static uint64_t fmt_range(uint32_t lo, uint32_t hi) { return (uint64_t)lo << 32 | hi; }
+
+// Next task of our own range, else half of the fullest other range
+static int fmt_take(FmtWorker *fw, uint32_t *task)
+{
+    FmtPool *pool = fw->pool;
+    if (fw->priv_lo < fw->priv_hi)
     {
-        char c = s.ptr[i];
-        if (c == ',' || c == '"' || c == '\n' || c == '\r')
-        {
-            need_quote = 1;
-            break;
-        }
+        *task = fw->priv_lo++;
+        return 1;
     }
-    
-    if (!need_quote)
+
+    _Atomic uint64_t *mine = &pool->ranges[fw->self].range;
+    uint64_t r;
+    for (;;)
     {
-        fwrite(s.ptr, 1, s.len, out);
-        return;
+        r = atomic_load(mine);
+        while ((uint32_t)(r >> 32) < (uint32_t)r)
+        {
+            if (atomic_compare_exchange_weak(mine, &r, r + ((uint64_t)1 << 32)))
+            {
+                *task = (uint32_t)(r >> 32);
+                return 1;
+            }
+        }
+
+        atomic_fetch_add(&pool->stealers, 1);
+        if (atomic_load(&pool->publishing))
+        {
+            atomic_fetch_sub(&pool->stealers, 1);
+            return 0;
+        }
+        // A round may have been published since we looked
+        r = atomic_load(mine);
+        if ((uint32_t)(r >> 32) >= (uint32_t)r)
+            break;
+        atomic_fetch_sub(&pool->stealers, 1);
     }
-    
-    fputc('"', out);
-    for (size_t i = 0; i < s.len; i++)
+
+    size_t victim = 0;
+    uint32_t best = 0;
+    uint64_t vr = 0;
+    for (size_t w = 0; w < pool->nworkers; w++)
     {
-        if (s.ptr[i] == '"')
-            fputc('"', out); // escape by doubling
-        fputc(s.ptr[i], out);
+        uint64_t x = atomic_load(&pool->ranges[w].range);
+        uint32_t left = (uint32_t)x - (uint32_t)(x >> 32);
+        if (w != fw->self && (uint32_t)(x >> 32) < (uint32_t)x && left > best)
+        {
+            best = left;
+            victim = w;
+            vr = x;
+        }
     }
-    fputc('"', out);
-}
 
-static StrSlice kv_get(const KVList *l, StrSlice key)
-{
-    for (size_t i = 0; i < l->len; i++)
+    // Steal [hi - half, hi); keep the first and publish the rest as our
+    // range, replacing the empty one we saw. Should that fail, the rest is
+    // worked off privately rather than lost.
+    int got = 0;
+    if (best)
     {
-        if (slice_eq(l->items[i].key, key))
-            return l->items[i].val;
+        uint32_t lo = (uint32_t)(vr >> 32), hi = (uint32_t)vr;
+        uint32_t half = (hi - lo + 1) / 2;
+        if (atomic_compare_exchange_strong(&pool->ranges[victim].range, &vr, fmt_range(lo, hi - half)))
+        {
+            *task = hi - half;
+            got = 1;
+            if (!atomic_compare_exchange_strong(mine, &r, fmt_range(hi - half + 1, hi)))
+            {
+                fw->priv_lo = hi - half + 1;
+                fw->priv_hi = hi;
+            }
+        }
     }
-    return slice_from_cstr(""); // missing becomes empty cell
+    atomic_fetch_sub(&pool->stealers, 1);
+    return got;
 }
 
-// --------------- Top-level parsing ---------------
-
-typedef struct
+static void *fmt_worker(void *arg)
 {
-    JValue **objs;
-    size_t len, cap;
-} ObjList;
+    FmtWorker *fw = (FmtWorker*)arg;
+    FmtPool *pool = fw->pool;
+    StrSlice *row = (StrSlice*)malloc((pool->ncols + 1) * sizeof(StrSlice));
+    if (!row) die("cannot allocate row");
 
-static void objlist_push(ObjList *ol, JValue *obj)
-{
-    if (ol->len == ol->cap)
+    unsigned spins = 0;
+    while (1)
     {
-        size_t oldcap = ol->cap;
-        size_t newcap = oldcap ? oldcap * 2 : 16;
-
-        ol->objs = (JValue **)arena_grow(
-            &A_perm,
-            ol->objs,
-            oldcap * sizeof(JValue *),
-            newcap * sizeof(JValue *),
-            _Alignof(JValue *)
-        );
-        ol->cap = newcap;
+        uint32_t k;
+        if (!fmt_take(fw, &k))
+        {
+            if (atomic_load(&pool->finished))
+                break;
+            spsc_wait(&spins);
+            continue;
+        }
+        spins = 0;
+        FmtTask *t = &pool->tasks[k % pool->round];
+        for (size_t r = t->row_begin; r < t->row_end; r++)
+        {
+            rowstore_fill(t->rows, r, row, pool->ncols);
+            csv_write_row(&t->buf, row, pool->ncols);
+        }
+        atomic_store_explicit(&t->done, 1, memory_order_release);
     }
-    ol->objs[ol->len++] = obj;
-}
-
-static void objlist_free(ObjList *ol)
-{
-    (void)ol;
+    free(row);
+    return NULL;
 }
 
-static ObjList parse_top(const char *input, size_t len, StrBuf *temp)
+// Pass 2 of the tree engine on nworkers threads: the rows of stores[0], then
+// stores[1], ... reach out in order
+static void format_rows_parallel(const RowStore *stores, size_t nstores, size_t ncols,
+                                 size_t nworkers, OutBuf *out)
 {
-    Parser p;
-    p_init(&p, input, len);
-    p_skip_ws(&p);
+    FmtPool pool;
+    memset(&pool, 0, sizeof pool);
+    pool.ncols = ncols;
+    pool.nworkers = nworkers;
+    pool.round = nworkers * FMT_ROUND_TASKS;
 
-    ObjList ol = (ObjList){0};
+    size_t per_task = FMT_TASK_CELLS / (ncols + 1);
+    if (per_task < 16)
+        per_task = 16;
+    size_t ntasks = 0;
+    for (size_t s = 0; s < nstores; s++)
+        ntasks += (stores[s].nrows + per_task - 1) / per_task;
+    if (ntasks > UINT32_MAX - 1)
+        die("too many rows");
 
-    JValue *top = parse_value(&p, temp);
-    p_skip_ws(&p);
+    pool.ranges = (FmtRange*)calloc(nworkers, sizeof(FmtRange));
+    pool.tasks = (FmtTask*)calloc(pool.round, sizeof(FmtTask));
+    FmtWorker *fw = (FmtWorker*)calloc(nworkers, sizeof(FmtWorker));
+    pthread_t *th = (pthread_t*)calloc(nworkers, sizeof(pthread_t));
+    if (!pool.ranges || !pool.tasks || !fw || !th)
+        die("cannot allocate format pool");
+    for (size_t k = 0; k < pool.round; k++)
+        out_init_mem(&pool.tasks[k].buf, 64u << 10);
 
-    if (top->type == J_OBJECT)
+    for (size_t w = 0; w < nworkers; w++)
     {
-        objlist_push(&ol, top);
-        return ol;
+        fw[w] = (FmtWorker){&pool, w, 0, 0};
+        if (pthread_create(&th[w], NULL, fmt_worker, &fw[w]) != 0)
+            die("cannot create format thread");
     }
-    if (top->type == J_ARRAY)
+
+    size_t s = 0, next = 0; // first row not yet in a task
+    for (size_t first = 0; first < ntasks; first += pool.round)
     {
-        for (size_t i = 0; i < top->as.array.len; i++)
+        size_t last = first + pool.round < ntasks ? first + pool.round : ntasks;
+
+        // Fill the slots before the ranges that hand them out
+        for (size_t k = first; k < last; k++)
+        {
+            while (next == stores[s].nrows)
+            {
+                s++;
+                next = 0;
+            }
+            FmtTask *t = &pool.tasks[k % pool.round];
+            t->rows = &stores[s];
+            t->row_begin = next;
+            t->row_end = next + per_task < stores[s].nrows ? next + per_task : stores[s].nrows;
+            next = t->row_end;
+            t->buf.len = 0;
+            atomic_store_explicit(&t->done, 0, memory_order_relaxed);
+        }
+        size_t n = last - first;
+        unsigned spins = 0;
+        atomic_store(&pool.publishing, 1);
+        while (atomic_load(&pool.stealers))
+            spsc_wait(&spins);
+        for (size_t w = 0; w < nworkers; w++)
+            atomic_store(&pool.ranges[w].range,
+                         fmt_range((uint32_t)(first + n * w / nworkers),
+                                   (uint32_t)(first + n * (w + 1) / nworkers)));
+        atomic_store(&pool.publishing, 0);
+
+        // Ordered commit
+        for (size_t k = first; k < last; k++)
         {
-            JValue *it = top->as.array.items[i];
-            if (it->type != J_OBJECT)
-                die("top array must contain objects");
-            objlist_push(&ol, it);
+            FmtTask *t = &pool.tasks[k % pool.round];
+            unsigned spins = 0;
+            while (!atomic_load_explicit(&t->done, memory_order_acquire))
+                spsc_wait(&spins);
+            out_write_n(out, t->buf.buf, t->buf.len);
         }
-        return ol;
     }
 
-    die("top-level JSON must be object or array of objects");
-    return ol;
+    atomic_store(&pool.finished, 1);
+    for (size_t w = 0; w < nworkers; w++)
+        pthread_join(th[w], NULL);
+    for (size_t k = 0; k < pool.round; k++)
+        out_free(&pool.tasks[k].buf);
+    free(pool.ranges);
+    free(pool.tasks);
+    free(fw);
+    free(th);
 }
 
 // --------------- File reading (single allocation) ---------------
@@ -983,24 +4699,88 @@ typedef struct {
     int is_mmap;
 } FileBuffer;
 
-static FileBuffer read_entire_file(const char *path)
+// "-" is stdin
+static int open_input(const char *path)
 {
+    if (strcmp(path, "-") == 0)
+        return STDIN_FILENO;
     int fd = open(path, O_RDONLY);
     if (fd < 0) die("cannot open input file");
-    
+    return fd;
+}
+
+// Only regular files have a size up front and can be mapped
+static int input_is_regular(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        die("cannot stat input file");
+    return S_ISREG(st.st_mode);
+}
+
+// Pipes and terminals: read to EOF into a doubling buffer
+static FileBuffer read_unsized(int fd)
+{
+    FileBuffer fb = {0};
+    size_t cap = 1u << 20;
+    fb.data = (char*)malloc(cap);
+    if (!fb.data) die("cannot allocate file buffer");
+    for (;;)
+    {
+        if (fb.len + 1 == cap)
+        {
+            cap *= 2;
+            fb.data = (char*)realloc(fb.data, cap);
+            if (!fb.data) die("cannot allocate file buffer");
+        }
+        ssize_t n = read(fd, fb.data + fb.len, cap - 1 - fb.len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            die("read failed");
+        if (n == 0)
+            break;
+        fb.len += (size_t)n;
+    }
+    fb.data[fb.len] = '\0';
+    return fb;
+}
+
+// Takes ownership of fd
+static FileBuffer read_entire_file(int fd)
+{
     struct stat st;
     if (fstat(fd, &st) < 0) {
         close(fd);
         die("cannot stat input file");
     }
+    if (!S_ISREG(st.st_mode)) {
+        FileBuffer fb = read_unsized(fd);
+        if (fd != STDIN_FILENO)
+            close(fd);
+        return fb;
+    }
     
     FileBuffer fb = {0};
     fb.len = (size_t)st.st_size;
     
     // Try mmap first for large files
     if (fb.len > 4096) {
-        fb.data = (char*)mmap(NULL, fb.len, PROT_READ, MAP_PRIVATE, fd, 0);
+        // --hugepages: fault the whole file in with the mapping (one kernel
+        // call instead of a fault per 4 KiB page) and ask for read-ahead
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (G_opt.hugepages)
+            flags |= MAP_POPULATE;
+#endif
+        fb.data = (char*)mmap(NULL, fb.len, PROT_READ, flags, fd, 0);
         if (fb.data != MAP_FAILED) {
+            if (G_opt.hugepages) {
+                madvise(fb.data, fb.len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+                madvise(fb.data, fb.len, MADV_HUGEPAGE);
+#endif
+            }
             fb.is_mmap = 1;
             close(fd);
             return fb;
@@ -1043,81 +4823,296 @@ static void file_buffer_free(FileBuffer *fb)
 
 // --------------- Main ---------------
 
-int main(int argc, char **argv)
+// Default engine: parse onto a tape, then flatten it for headers and rows
+static void run_tree(const char *input, size_t len, StructIndex *ix, OutBuf *out)
 {
-    if (argc != 2)
+    KeySet headers = (KeySet){0};
+    headers_init(&headers);
+    PathTrie paths;
+    path_init(&paths, &headers);
+    PathTrie *proj = G_opt.pushdown ? &paths : NULL;
+    
+    // Parse using string slices; one tape per parse worker
+    Tape *tapes = (Tape*)malloc(G_opt.nthreads * sizeof *tapes);
+    if (!tapes) die("cannot allocate tapes");
+    size_t ntapes = 1;
+    if (G_opt.nthreads > 1)
+        ntapes = parse_top_parallel(input, len, G_opt.nthreads, ix, &G_tmpbuf1, proj, tapes);
+    else
     {
-        fprintf(stderr, "Usage: %s input.json > out.csv\n", argv[0]);
-        return 2;
+        tape_init(&tapes[0], input, len, proj);
+        parse_top(input, len, ix, &G_tmpbuf1, &tapes[0]);
     }
     
-    const char *path = argv[1];
+    // Pass 1: flatten every record once, collecting headers as we go;
+    // one row store per tape
+    RowStore *stores = (RowStore*)calloc(ntapes, sizeof *stores);
+    Arena *arenas = NULL;
+    if (!stores) die("cannot allocate row stores");
+    if (ntapes > 1)
+    {
+        arenas = (Arena*)calloc(ntapes, sizeof *arenas);
+        if (!arenas) die("cannot allocate arenas");
+        flatten_parallel(tapes, ntapes, &headers, stores, arenas);
+    }
+    else
+    {
+        FlatOut fo = {.paths = &paths, .rows = &stores[0]};
+        const Tape *t = &tapes[0];
+        for (size_t i = 0; i < t->len; i = tape_next(t, i))
+        {
+            flatten_object(t, i, PATH_ROOT, &fo, &G_tmpbuf1);
+            rowstore_end_row(&stores[0]);
+        }
+    }
     
-    // Read entire file into memory
-    FileBuffer input = read_entire_file(path);
+    // Print header row
+    csv_write_header(out, &headers);
     
-    // Size arenas based on input size
-    size_t perm_cap = input.len * 16 + (64u << 20);
-    size_t tmp_cap  = input.len * 2 + (32u << 20);
+    // Pass 2: scatter stored cells into column slots, then one sequential walk
+    if (G_opt.nthreads > 1)
+        format_rows_parallel(stores, ntapes, headers.len, G_opt.nthreads, out);
+    else
+    {
+        StrSlice *row = (StrSlice*)malloc((headers.len + 1) * sizeof(StrSlice));
+        if (!row) die("cannot allocate row");
+        for (size_t i = 0; i < stores[0].nrows; i++)
+        {
+            rowstore_fill(&stores[0], i, row, headers.len);
+            csv_write_row(out, row, headers.len);
+        }
+        free(row);
+    }
     
-    arena_init(&A_perm, perm_cap);
-    arena_init(&A_tmp, tmp_cap);
+    if (arenas)
+        for (size_t k = 0; k < ntapes; k++)
+            arena_destroy(&arenas[k]);
+    free(arenas);
+    free(stores);
+    path_free(&paths);
+    keyset_free(&headers);
+    for (size_t k = 0; k < ntapes; k++)
+        tape_free(&tapes[k]);
+    free(tapes);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] input.json|- > out.csv\n"
+        "  --direct     stream records straight into CSV rows without building a tree\n"
+        "               (parses the input twice, memory O(record + header))\n"
+        "  --index      parse from a SIMD structural index built one batch ahead\n"
+        "               (off by default: slower than the byte scanner on these inputs)\n"
+        "  --no-index   scan input byte by byte (the default)\n"
+        "  --threads N  parse the top-level array in N chunks concurrently and format\n"
+        "               rows on N work-stealing threads\n"
+        "  --ndjson     input is newline-delimited JSON, one object per line\n"
+        "  --columns a,b.c  output only these columns (dotted paths), in this order;\n"
+        "               other members are skipped without being parsed\n"
+        "  --where EXPR keep only records matching EXPR (repeatable, ANDed):\n"
+        "               a.b=x  a.b!=x  a.b^=prefix  a.b<n  a.b<=n  a.b>n  a.b>=n\n"
+        "               'a.b in x,y,z'; a record lacking the column never matches\n"
+        "  --validate-utf8  fail unless the whole input is well-formed UTF-8 (checked\n"
+        "               per framed record when --stream reads a pipe)\n"
+        "  --max-depth N  fail on records nesting more than N containers (1024)\n"
+        "  --stream     single pass: write rows as records arrive and patch the header\n"
+        "               in at the end (output must be a regular file)\n"
+        "  --header-reserve BYTES  space kept for the header in --stream mode (64 KiB)\n"
+        "  --pipeline   with --stream: read, parse, format and write on four threads\n"
+        "  --schema-cache FILE  with --direct: reuse the header saved in FILE and skip\n"
+        "               pass 1; rediscovers (and rewrites FILE) if the input differs\n"
+        "  -            read standard input; with --stream a pipe is consumed through a\n"
+        "               bounded window instead of being loaded whole\n"
+        "  --mem-stats  print arena bytes reserved/used/high-water and page faults\n"
+        "               to stderr\n"
+        "  --hugepages  prefault the input mapping (MAP_POPULATE, sequential\n"
+        "               read-ahead) and back arena blocks with 2 MiB pages\n"
+        "  -o FILE      write CSV to FILE instead of stdout\n",
+        prog);
+    exit(2);
+}
+
+// Numeric option value: digits only, no sign, whitespace or trailing
+// characters, and no overflow. Returns 0 if s is not such a number.
+static int parse_count(const char *s, unsigned long long *out)
+{
+    if (!isdigit((unsigned char)s[0]))
+        return 0;
+    char *end;
+    errno = 0;
+    *out = strtoull(s, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+    int direct = 0;
+    int stream = 0;
+    int mem_stats = 0;
+    const char *out_path = NULL;
+    const char **where = (const char**)calloc((size_t)argc, sizeof(char*));
+    size_t nwhere = 0;
+    if (!where) die("cannot allocate options");
     
-    // Initialize reusable buffers
-    strbuf_init(&G_tmpbuf1, 4096);
-    strbuf_init(&G_tmpbuf2, 4096);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--index") == 0)
+            G_opt.use_index = 1;
+        else if (strcmp(argv[i], "--no-index") == 0)
+            G_opt.use_index = 0;
+        else if (strcmp(argv[i], "--direct") == 0)
+            direct = 1;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            unsigned long long n;
+            if (!parse_count(argv[++i], &n) || n < 1 || n > 1024)
+                usage(argv[0]);
+            G_opt.nthreads = (size_t)n;
+        }
+        else if (strcmp(argv[i], "--ndjson") == 0)
+            G_opt.ndjson = 1;
+        else if (strcmp(argv[i], "--columns") == 0 && i + 1 < argc)
+            G_opt.columns = argv[++i];
+        else if (strcmp(argv[i], "--where") == 0 && i + 1 < argc)
+            where[nwhere++] = argv[++i];
+        else if (strcmp(argv[i], "--stream") == 0)
+            stream = 1;
+        else if (strcmp(argv[i], "--header-reserve") == 0 && i + 1 < argc)
+        {
+            unsigned long long n;
+            if (!parse_count(argv[++i], &n) || n > SIZE_MAX / 2)
+                usage(argv[0]);
+            G_opt.header_reserve = (size_t)n;
+        }
+        else if (strcmp(argv[i], "--mem-stats") == 0)
+            mem_stats = 1;
+        else if (strcmp(argv[i], "--hugepages") == 0)
+            G_opt.hugepages = 1;
+        else if (strcmp(argv[i], "--pipeline") == 0)
+            G_opt.pipeline = 1;
+        else if (strcmp(argv[i], "--validate-utf8") == 0)
+            G_opt.validate_utf8 = 1;
+        else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc)
+        {
+            unsigned long long n;
+            if (!parse_count(argv[++i], &n) || n < 1 || n > SIZE_MAX / 2)
+                usage(argv[0]);
+            G_opt.max_depth = (size_t)n;
+        }
+        else if (strcmp(argv[i], "--schema-cache") == 0 && i + 1 < argc)
+            G_opt.schema_cache = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_path = argv[++i];
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+            usage(argv[0]);
+        else if (!path)
+            path = argv[i];
+        else
+            usage(argv[0]);
+    }
+    if (!path)
+        usage(argv[0]);
+    if ((direct || stream) && G_opt.nthreads > 1)
+        die("--threads is not supported with --direct or --stream");
+    if (G_opt.pipeline && !stream)
+        die("--pipeline requires --stream");
+    if (G_opt.schema_cache && !direct)
+        die("--schema-cache requires --direct");
+    
+    // Read entire file into memory, unless a pipe can be streamed through a window
+    int in_fd = open_input(path);
+    FileBuffer input = {0};
+    InWindow win;
+    InWindow *winp = NULL;
+    if (stream && !input_is_regular(in_fd))
+    {
+        win_init(&win, in_fd, 1u << 20);
+        winp = &win;
+    }
+    else
+        input = read_entire_file(in_fd);
+    if (G_opt.validate_utf8)
+        utf8_validate(input.data, input.len);
     
-    // Parse using string slices
-    ObjList objs = parse_top(input.data, input.len, &G_tmpbuf1);
+    // Arenas grow block by block with what is actually stored: headers (and
+    // the row store for the default engine) in perm, one record's cells in tmp
+    arena_init(&A_perm, 1u << 20, G_opt.hugepages);
+    arena_init(&A_tmp, 0, G_opt.hugepages);
     
-    // Pass 1: collect headers
-    KeySet headers = (KeySet){0};
-    for (size_t i = 0; i < objs.len; i++)
+    if (G_opt.columns)
+        proj_init(G_opt.columns);
+    // A cached header is only valid for the options that produced it
+    G_opt.schema_key = slice_hash(slice_from_cstr(G_opt.columns ? G_opt.columns : ""));
+    for (size_t i = 0; i < nwhere; i++)
     {
-        size_t mark = arena_mark(&A_tmp);
-        
-        KVList kv = (KVList){0};
-        flatten_object(objs.objs[i], slice_make("", 0), &kv, &G_tmpbuf1);
-        for (size_t j = 0; j < kv.len; j++)
-            keyset_add(&headers, kv.items[j].key);
-        
-        arena_reset(&A_tmp, mark);
+        where_add(where[i]);
+        G_opt.schema_key = (G_opt.schema_key ^ slice_hash(slice_from_cstr(where[i]))) * 0x100000001b3ull;
     }
+    free(where);
+    G_opt.pushdown = G_opt.columns || G_nwhere;
     
-    // Print header row
-    for (size_t i = 0; i < headers.len; i++)
+    // Initialize reusable buffers
+    strbuf_init(&G_tmpbuf1, 4096);
+    strbuf_init(&G_tmpbuf2, 4096);
+    
+    // Stage 1 runs lazily inside the parser, one batch ahead of stage 2
+    StructIndex *ix = NULL;
+    if (G_opt.use_index)
     {
-        if (i)
-            fputc(',', stdout);
-        csv_write_slice(stdout, headers.keys[i]);
+        ix = (StructIndex*)malloc(sizeof *ix);
+        if (!ix) die("cannot allocate structural index");
     }
-    fputc('\n', stdout);
     
-    // Pass 2: output rows
-    for (size_t i = 0; i < objs.len; i++)
+    FILE *out_file = stdout;
+    if (out_path && !(out_file = fopen(out_path, "w+b")))
+        die("cannot open output file");
+    
+    // A stale schema cache rewinds the output
+    struct stat out_st;
+    if (G_opt.schema_cache && (fstat(fileno(out_file), &out_st) < 0 || !S_ISREG(out_st.st_mode)))
+        die("--schema-cache needs a seekable output file");
+    
+    // We perform our own batching via OutBuf, so disable stdio buffering
+    setvbuf(out_file, NULL, _IONBF, 0);
+    OutBuf out;
+    out_init(&out, out_file, 1u << 20); // 1 MiB output buffer
+    
+    if (stream)
+        run_stream(input.data, input.len, winp, ix, &out);
+    else if (direct)
+        run_direct(input.data, input.len, ix, &out);
+    else
+        run_tree(input.data, input.len, ix, &out);
+    
+    out_free(&out);
+    if (out_file != stdout && fclose(out_file) != 0)
+        die("write failed");
+    
+    if (mem_stats)
     {
-        size_t mark = arena_mark(&A_tmp);
-        
-        KVList kv = (KVList){0};
-        flatten_object(objs.objs[i], slice_make("", 0), &kv, &G_tmpbuf1);
-        for (size_t c = 0; c < headers.len; c++)
-        {
-            if (c)
-                fputc(',', stdout);
-            StrSlice val = kv_get(&kv, headers.keys[c]);
-            csv_write_slice(stdout, val);
-        }
-        fputc('\n', stdout);
-        
-        arena_reset(&A_tmp, mark);
+        arena_print_stats("perm", &A_perm);
+        arena_print_stats("tmp", &A_tmp);
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0)
+            fprintf(stderr, "page faults minor %ld major %ld\n", ru.ru_minflt, ru.ru_majflt);
     }
     
     // Cleanup
+    free(ix);
     strbuf_destroy(&G_tmpbuf1);
     strbuf_destroy(&G_tmpbuf2);
     arena_destroy(&A_tmp);
     arena_destroy(&A_perm);
-    file_buffer_free(&input);
+    if (winp)
+    {
+        win_free(winp);
+        if (in_fd != STDIN_FILENO)
+            close(in_fd);
+    }
+    else
+        file_buffer_free(&input);
     
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,115 @@
+#!/usr/bin/env bash
+# Regression checks for json2csv_memory_opt: each case feeds a small input
+# and checks the exit status and, where it matters, the CSV.
+set -euo pipefail
+
+# ===== Config =====
+BIN="${BIN:-./json2csv_opt}"
+# ==================
+
+[[ -x "$BIN" ]] || { echo "Missing BIN: $BIN"; exit 1; }
+
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+fail=0
+
+# expect_fail NAME INPUT [options...]: the run must exit non-zero
+expect_fail() {
+  local name="$1" input="$2"; shift 2
+  printf '%s' "$input" > "$TMP/in.json"
+  if "$BIN" "$@" "$TMP/in.json" > /dev/null 2>&1; then
+    echo "FAIL $name (accepted)"; fail=1
+  else
+    echo "ok   $name"
+  fi
+}
+
+# expect_csv NAME INPUT EXPECTED [options...]: the run must print EXPECTED
+expect_csv() {
+  local name="$1" input="$2" expected="$3"; shift 3
+  printf '%s' "$input" > "$TMP/in.json"
+  printf '%s' "$expected" > "$TMP/expected.csv"
+  if "$BIN" "$@" "$TMP/in.json" > "$TMP/got.csv" 2> "$TMP/err.txt" &&
+     cmp -s "$TMP/expected.csv" "$TMP/got.csv"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"; diff "$TMP/expected.csv" "$TMP/got.csv" || true
+    cat "$TMP/err.txt"; fail=1
+  fi
+}
+
+# expect_same NAME FILE [options...]: the run must print what a plain run
+# prints, within TIMEOUT seconds (catches hangs in the thread pools)
+expect_same() {
+  local name="$1" file="$2"; shift 2
+  "$BIN" "$file" > "$TMP/expected.csv"
+  if timeout "${TIMEOUT:-60}" "$BIN" "$@" "$file" > "$TMP/got.csv" 2> "$TMP/err.txt" &&
+     cmp -s "$TMP/expected.csv" "$TMP/got.csv"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"; cat "$TMP/err.txt"; fail=1
+  fi
+}
+
+# --threads splits the top array by counting brackets; malformed closers
+# must still be rejected like the serial parser does
+expect_fail "threads: top array closed by }" '[{"a":1}}' --threads 2
+expect_fail "threads: last of two records closed by }" '[{"a":1},{"b":2}}' --threads 2
+expect_csv  "threads: well-formed array" '[{"a":1},{"b":2}]' $'a,b\n1,\n,2\n' --threads 2
+
+# Numeric options take a whole decimal number; trailing garbage, signs and
+# overflow are usage errors instead of being read as a prefix
+expect_fail "--threads 4x" '[{"a":1}]' --threads 4x
+expect_fail "--threads -2" '[{"a":1}]' --threads -2
+expect_fail "--max-depth abc" '[{"a":1}]' --max-depth abc
+expect_fail "--max-depth 10k" '[{"a":1}]' --max-depth 10k
+expect_fail "--header-reserve 64K" '[{"a":1}]' --stream -o "$TMP/out.csv" --header-reserve 64K
+expect_fail "--header-reserve overflow" '[{"a":1}]' --stream -o "$TMP/out.csv" --header-reserve 99999999999999999999999
+expect_csv  "--threads 2 --max-depth 8" '[{"a":1}]' $'a\n1\n' --threads 2 --max-depth 8
+
+# Dotted names are built from the path trie without a depth cap
+open300="$(printf '{"k":%.0s' {1..300})"; close300="$(printf '}%.0s' {1..300})"
+name300="$(printf 'k.%.0s' {1..300})v"
+expect_csv  "300 nested objects" "[${open300}{\"v\":1}${close300}]" "${name300}"$'\n1\n'
+expect_csv  "300 nested objects, --direct" "[${open300}{\"v\":1}${close300}]" "${name300}"$'\n1\n' --direct
+
+# --max-depth: the default (1024) rejects deeper records cleanly; a larger
+# limit converts them, objects included
+open2000="$(printf '{"k":%.0s' {1..2000})"; close2000="$(printf '}%.0s' {1..2000})"
+name2000="$(printf 'k.%.0s' {1..2000})v"
+expect_fail "2001 nested objects over the default --max-depth" "[${open2000}{\"v\":1}${close2000}]"
+expect_fail "2001 nested objects over the default --max-depth, --direct" "[${open2000}{\"v\":1}${close2000}]" --direct
+expect_csv  "2001 nested objects, --max-depth 5000" "[${open2000}{\"v\":1}${close2000}]" "${name2000}"$'\n1\n' --max-depth 5000
+expect_csv  "2001 nested objects, --max-depth 5000 --direct" "[${open2000}{\"v\":1}${close2000}]" "${name2000}"$'\n1\n' --max-depth 5000 --direct
+
+# --where: the earliest operator wins, so values may contain " in "
+where_in='[{"title":"sign in page","n":1},{"title":"home","n":2},{"title":"x","tags":"a=b"}]'
+expect_csv  "--where value containing ' in '" "$where_in" $'title,n\nsign in page,1\n' --where 'title=sign in page'
+expect_csv  "--where value containing ' in ', --direct" "$where_in" $'title,n\nsign in page,1\n' --direct --where 'title=sign in page'
+expect_csv  "--where 'in' list containing =" "$where_in" $'title,tags\nx,a=b\n' --where 'tags in a=b,c'
+
+# --where ranges: the parser's int64 value compares exactly past 2^53
+big='[{"id":9007199254740993},{"id":9007199254740992},{"id":1.5}]'
+expect_csv  "--where int64 range past 2^53" "$big" $'id\n9007199254740993\n' --where 'id>9007199254740992'
+expect_csv  "--where int64 range past 2^53, --direct" "$big" $'id\n9007199254740993\n' --direct --where 'id>9007199254740992'
+expect_csv  "--where mixed int/double range" "$big" $'id\n1.5\n' --where 'id<2'
+
+# --threads 2 pass 2 over many rounds: 4200 sparse columns make 16-row tasks,
+# so 40k rows take ~150 rounds of publishing and stealing
+{
+  echo '['
+  for ((i = 0; i < 40000; i++)); do
+    (( i )) && echo ','
+    printf '{"k%d":%d}' $((i % 4200)) "$i"
+  done
+  echo ']'
+} > "$TMP/sparse.json"
+for run in 1 2 3 4 5; do
+  expect_same "--threads 2, many rounds (run $run)" "$TMP/sparse.json" --threads 2
+done
+
+# --index is opt-in; parsing from the structural index must print the same
+expect_same "--index" "$TMP/sparse.json" --index
+expect_same "--index --direct" "$TMP/sparse.json" --index --direct
+
+exit "$fail"